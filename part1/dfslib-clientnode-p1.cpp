@@ -32,6 +32,7 @@ using dfs_service::FileData;
 using dfs_service::FileInfo;
 using dfs_service::FileList;
 using dfs_service::RequestFile;
+using dfs_service::StoreRequest;
 using dfs_service::ReturnMsg;
 using dfs_service::Void;
 
@@ -80,52 +81,63 @@ StatusCode DFSClientNodeP1::Store(const std::string &filename) {
     /* 1. Initialization */
     std::string file_path = WrapPath(filename);
     FileInfo file_info; 
-    
-    std::unique_ptr <ClientWriter<FileData>> client_writer = service_stub->StoreFile(&context, &file_info);  // ???
 
     std::ifstream ifs;
-    ifs.open(file_path);
+    ifs.open(file_path, std::ios::in | std::ios::binary);
     if (!ifs) {
         dfs_log(LL_ERROR) << "File not found or fail to open: " << file_path;
         return StatusCode::NOT_FOUND;
     }
     
-    FileData file_data;
+    std::unique_ptr <ClientWriter<StoreRequest>> client_writer = service_stub->StoreFile(&context, &file_info);
+
+    StoreRequest store_request;
     size_t file_size;
     size_t bytes_sent = 0, total_sent = 0;
-    char buffer[BUFSIZE];
 
     struct stat st;
     stat(file_path.c_str(), &st);
     file_size = st.st_size;
 
     /* 2. Sending file name */
-    file_data.set_data(filename);
-    client_writer->Write(file_data);
+    store_request.mutable_header()->set_request_file_name(filename);
 
     /* 3. Sending file data */
     dfs_log(LL_SYSINFO) << "Client start to store file to server: " << file_path;
 
-    while(total_sent < file_size) {
-        if ((file_size - total_sent) >= (BUFSIZE - 1)) {
-            bytes_sent = BUFSIZE - 1;
+    auto start_time = std::chrono::steady_clock::now();
+    bool write_ok = client_writer->Write(store_request);
+
+    // The server answers the header with the largest chunk it accepts
+    if (write_ok) {
+        client_writer->WaitForInitialMetadata();
+    }
+    DFSChunkSizer chunk_sizer(dfs_peer_chunk_limit(context.GetServerInitialMetadata()));
+
+    while(write_ok && total_sent < file_size) {
+        bytes_sent = std::min(chunk_sizer.ChunkSize(), file_size - total_sent);
+
+        std::string *data = store_request.mutable_chunk();
+        data->resize(bytes_sent);
+        if (!ifs.read(&(*data)[0], bytes_sent)) {
+            break;
         }
-        else {
-            bytes_sent = file_size - total_sent;
-        }        
-
-        if (ifs.good() && ifs.is_open()) {
-            ifs.read(buffer, bytes_sent);
-            file_data.set_data(buffer, bytes_sent);
-            client_writer->Write(file_data);
-            total_sent += bytes_sent;
+
+        auto write_start = std::chrono::steady_clock::now();
+        if (!client_writer->Write(store_request)) {
+            // The server already ended the call, Finish below reports why
+            write_ok = false;
+            break;
         }
-        memset(buffer, 0, sizeof(char)*BUFSIZE);
+        chunk_sizer.Record(bytes_sent, std::chrono::steady_clock::now() - write_start);
+        total_sent += bytes_sent;
     }
     ifs.close();
 
-    if (total_sent != file_size) {
+    if (write_ok && total_sent != file_size) {
         dfs_log(LL_ERROR) << "Client failed to send complete data";
+        context.TryCancel();
+        client_writer->Finish();
         return StatusCode::CANCELLED;
     }
 
@@ -133,7 +145,10 @@ StatusCode DFSClientNodeP1::Store(const std::string &filename) {
     client_writer->WritesDone();
     Status status_code = client_writer->Finish();
     if (status_code.ok()) {
-        dfs_log(LL_SYSINFO) << "Client successfully send file: " << filename << " to server";
+        dfs_log(LL_SYSINFO) << "Client successfully send file: " << filename << " to server, "
+                            << total_sent << " bytes at "
+                            << dfs_megabytes_per_second(total_sent, std::chrono::steady_clock::now() - start_time)
+                            << " MB/s, final chunk size " << chunk_sizer.ChunkSize();
         return status_code.error_code();
     }
     else {
@@ -173,6 +188,7 @@ StatusCode DFSClientNodeP1::Fetch(const std::string &filename) {
     RequestFile request_file;
     request_file.set_request_file_name(filename);
     std::string file_path = WrapPath(filename);
+    context.AddMetadata(DFS_CHUNK_SIZE_KEY, std::to_string(DFS_MAX_CHUNK_SIZE));
     std::unique_ptr <ClientReader<FileData>> client_reader = service_stub->FetchFile(&context, request_file);   
     std::ofstream ofs;
 
@@ -183,11 +199,11 @@ StatusCode DFSClientNodeP1::Fetch(const std::string &filename) {
     while (client_reader->Read(&file_data)) {
         // This is not sure yet
         if (!ofs.is_open()) {
-            ofs.open(file_path, std::ios::trunc);
+            ofs.open(file_path, std::ios::trunc | std::ios::binary);
         }
 
         const std::string &data = file_data.data();
-        ofs << data;
+        ofs.write(data.data(), data.size());
     }
     ofs.close();
 
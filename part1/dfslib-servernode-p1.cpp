@@ -29,9 +29,99 @@ using dfs_service::FileData;
 using dfs_service::FileInfo;
 using dfs_service::FileList;
 using dfs_service::RequestFile;
+using dfs_service::StoreRequest;
 using dfs_service::ReturnMsg;
 using dfs_service::Void;
 
+/**
+ * Streams a memory-mapped file to the client for FetchFile.
+ *
+ * Each chunk is a FileData message serialized by hand around a slice
+ * of the mapping, so file bytes go from the page cache to the wire
+ * without being copied into a std::string first. The reactor deletes
+ * itself once gRPC is done with the call.
+ */
+class DFSFetchReactor : public grpc::ServerWriteReactor<grpc::ByteBuffer> {
+
+private:
+    /** The mapped file being sent **/
+    std::shared_ptr<DFSMappedFile> file;
+
+    /** The file name, for logging **/
+    std::string file_name;
+
+    /** Picks the size of each chunk **/
+    DFSChunkSizer chunk_sizer;
+
+    /** The chunk currently being written **/
+    grpc::ByteBuffer chunk;
+
+    /** Offset of the current chunk in the file **/
+    size_t offset;
+
+    /** Length of the current chunk **/
+    size_t chunk_length;
+
+    std::chrono::steady_clock::time_point start_time;
+    std::chrono::steady_clock::time_point write_start;
+
+    void NextWrite() {
+        if (this->offset >= this->file->Size()) {
+            dfs_log(LL_SYSINFO) << "Server sent " << this->offset << " bytes of " << this->file_name << " at "
+                                << dfs_megabytes_per_second(this->offset, std::chrono::steady_clock::now() - this->start_time)
+                                << " MB/s, final chunk size " << this->chunk_sizer.ChunkSize();
+            Finish(Status::OK);
+            return;
+        }
+
+        // Bytes already sent can't be taken back, so a file changed by an
+        // outside writer aborts the fetch and the client syncs again later
+        if (this->file->Changed()) {
+            dfs_log(LL_ERROR) << "File changed during transfer: " << this->file_name;
+            Finish(Status(StatusCode::ABORTED, "File changed during transfer"));
+            return;
+        }
+
+        this->chunk_length = std::min(this->chunk_sizer.ChunkSize(), this->file->Size() - this->offset);
+        this->chunk = dfs_mapped_chunk(this->file, this->offset, this->chunk_length);
+        this->write_start = std::chrono::steady_clock::now();
+        StartWrite(&this->chunk);
+    }
+
+public:
+    /**
+     * Finish the call straight away with an error status
+     *
+     * @param status
+     */
+    explicit DFSFetchReactor(const Status &status) :
+        chunk_sizer(DFS_MIN_CHUNK_SIZE), offset(0), chunk_length(0) {
+        Finish(status);
+    }
+
+    DFSFetchReactor(std::shared_ptr<DFSMappedFile> file, const std::string &file_name, size_t chunk_limit) :
+        file(file), file_name(file_name), chunk_sizer(chunk_limit), offset(0), chunk_length(0),
+        start_time(std::chrono::steady_clock::now()) {
+        dfs_log(LL_SYSINFO) << "Server starts sending data for file: " << file_name;
+        NextWrite();
+    }
+
+    void OnWriteDone(bool ok) override {
+        if (!ok) {
+            dfs_log(LL_ERROR) << "Deadline exceeded or Client cancelled, abandoning";
+            Finish(Status(StatusCode::CANCELLED, "Deadline exceeded or Client cancelled, abandoning"));
+            return;
+        }
+        this->chunk_sizer.Record(this->chunk_length, std::chrono::steady_clock::now() - this->write_start);
+        this->offset += this->chunk_length;
+        NextWrite();
+    }
+
+    void OnDone() override {
+        delete this;
+    }
+};
+
 //
 // STUDENT INSTRUCTION:
 //
@@ -62,7 +152,7 @@ using dfs_service::Void;
 //          /** code implementation here **/
 //      }
 //
-class DFSServiceImpl final : public DFSService::Service {
+class DFSServiceImpl final : public DFSService::WithRawCallbackMethod_FetchFile<DFSService::Service> {
 
 private:
 
@@ -95,21 +185,30 @@ public:
     //
 
     Status StoreFile(ServerContext *context, 
-            ServerReader<FileData> *server_reader, FileInfo *file_info) override {
+            ServerReader<StoreRequest> *server_reader, FileInfo *file_info) override {
         /* 1. Read file name */
-        FileData file_data;
+        StoreRequest store_request;
         std::string file_name;
         std::string file_path;
-        std::ofstream ofs;
 
-        server_reader->Read(&file_data);
-        file_name = file_data.data();
+        if (!server_reader->Read(&store_request) || !store_request.has_header()) {
+            std::string error_msg = "Store request is missing its file header";
+            dfs_log(LL_ERROR) << error_msg;
+            return Status(StatusCode::INVALID_ARGUMENT, error_msg);
+        }
+        file_name = store_request.header().request_file_name();
         file_path = WrapPath(file_name);
-        
+
+        // Tell the client the largest chunk this side accepts before the body comes
+        context->AddInitialMetadata(DFS_CHUNK_SIZE_KEY, std::to_string(DFS_MAX_CHUNK_SIZE));
+        server_reader->SendInitialMetadata();
+
         /* 2. Receive file data */
         dfs_log(LL_SYSINFO) << "Server starts storing data to file: " << file_name;
+        DFSFileLock file_lock(file_path);
+        std::ofstream ofs(file_path, std::ios::trunc | std::ios::binary);
 
-        while (server_reader->Read(&file_data)) {
+        while (server_reader->Read(&store_request)) {
             // Check for deadline
             if (context->IsCancelled()) {
                 std::string error_msg = "Deadline exceeded or Client cancelled, abandoning";
@@ -117,11 +216,8 @@ public:
                 return Status(StatusCode::DEADLINE_EXCEEDED, error_msg);
             }
 
-            if (!ofs.is_open()) {
-                ofs.open(file_path, std::ios::trunc);
-            }
-            std::string data = file_data.data();
-            ofs << data;
+            const std::string &data = store_request.chunk();
+            ofs.write(data.data(), data.size());
         }
         ofs.close();
 
@@ -142,67 +238,35 @@ public:
     }
 
 
-    Status FetchFile(ServerContext *context,
-            const RequestFile *request_file, ServerWriter<FileData> *server_writer) override {
+    grpc::ServerWriteReactor<grpc::ByteBuffer>* FetchFile(grpc::CallbackServerContext *context,
+            const grpc::ByteBuffer *request) override {
         /* 1. Make path */
-        std::string file_name = request_file->request_file_name();
+        RequestFile request_file;
+        grpc::ByteBuffer request_buffer(*request);
+        if (!grpc::SerializationTraits<RequestFile>::Deserialize(&request_buffer, &request_file).ok()) {
+            dfs_log(LL_ERROR) << "Server failed to parse fetch request";
+            return new DFSFetchReactor(Status(StatusCode::INVALID_ARGUMENT, "Malformed fetch request"));
+        }
+        std::string file_name = request_file.request_file_name();
         std::string file_path = WrapPath(file_name);
 
         /* 2. Check if the file is in server */
-        FileData file_data;
-        char buffer[BUFSIZE];
-        std::ifstream ifs;
-
-        ifs.open(file_path, std::ios::in);
-        if (!ifs) {
+        struct stat st;
+        if (stat(file_path.c_str(), &st) == -1) {
             std::stringstream str_stream;
             str_stream << "File not found for " << file_path;
             dfs_log(LL_ERROR) << str_stream.str();
-            return Status(StatusCode::NOT_FOUND, str_stream.str());
+            return new DFSFetchReactor(Status(StatusCode::NOT_FOUND, str_stream.str()));
         }
 
         /* 3. Send file data in chunks to client */
-        size_t bytes_sent = 0, total_sent = 0;
-        struct stat st;
-        if (stat(file_path.c_str(), &st) == -1) {
-            dfs_log(LL_ERROR) << "Unknown error at server";
-            return Status(StatusCode::INTERNAL, "Unknown error at server");
-        }        
-        size_t file_size = st.st_size;
-        
-        dfs_log(LL_SYSINFO) << "Server starts sending data for file: " << file_name;
-        
-        while (total_sent < file_size) {
-            // Check for deadline
-            if (context->IsCancelled()) {
-                const std::string &error_msg = "Deadline exceeded or Client cancelled, abandoning";
-                dfs_log(LL_ERROR) << error_msg;
-                return Status(StatusCode::DEADLINE_EXCEEDED, error_msg);
-            }
-
-            if ((file_size - total_sent) >= (BUFSIZE - 1)) {
-                bytes_sent = BUFSIZE - 1;
-            }
-            else {
-                bytes_sent = file_size - total_sent;
-            }
-
-            if (ifs.good() && ifs.is_open()) {
-                ifs.read(buffer, bytes_sent);
-                file_data.set_data(buffer, bytes_sent);
-                server_writer->Write(file_data);
-                total_sent += bytes_sent;
-            }
+        std::shared_ptr<DFSMappedFile> mapped_file = DFSMappedFile::Open(file_path);
+        if (!mapped_file) {
+            dfs_log(LL_ERROR) << "Server failed to map " << file_path;
+            return new DFSFetchReactor(Status(StatusCode::UNAVAILABLE, "Server failed to open file"));
         }
-        ifs.close();
 
-        if (total_sent != file_size) {
-            dfs_log(LL_ERROR) << "Server failed to send complete data";
-            return Status(StatusCode::INTERNAL, "Server failed to send complete data");
-        }
-
-        dfs_log(LL_SYSINFO) << "Server successful send file: " << file_name;
-        return Status::OK;
+        return new DFSFetchReactor(mapped_file, file_name, dfs_peer_chunk_limit(context->client_metadata()));
     }
 
 
@@ -349,6 +413,7 @@ void DFSServerNode::Start() {
     ServerBuilder builder;
     builder.AddListeningPort(this->server_address, grpc::InsecureServerCredentials());
     builder.RegisterService(&service);
+    builder.SetMaxReceiveMessageSize(DFS_MAX_MESSAGE_SIZE);
     this->server = builder.BuildAndStart();
     dfs_log(LL_SYSINFO) << "DFSServerNode server listening on " << this->server_address;
     this->server->Wait();
@@ -1,7 +1,16 @@
 #include <string>
+#include <chrono>
+#include <cstdlib>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <cstddef>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "dfslib-shared-p1.h"
@@ -23,3 +32,111 @@ dfs_log_level_e DFS_LOG_LEVEL = LL_ERROR;
 // Just be aware they are always submitted, so they should
 // be compilable.
 //
+
+size_t dfs_peer_chunk_limit(const std::multimap<grpc::string_ref, grpc::string_ref>& metadata) {
+    auto iter = metadata.find(DFS_CHUNK_SIZE_KEY);
+    if (iter == metadata.end()) {
+        return DFS_MIN_CHUNK_SIZE;
+    }
+
+    std::string value(iter->second.data(), iter->second.size());
+    size_t limit = static_cast<size_t>(strtoul(value.c_str(), NULL, 10));
+    return std::max<size_t>(std::min<size_t>(limit, DFS_MAX_CHUNK_SIZE), BUFSIZE - 1);
+}
+
+double dfs_megabytes_per_second(size_t bytes, std::chrono::steady_clock::duration elapsed) {
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    return (bytes / (1024.0 * 1024.0)) / std::max(seconds, 1e-6);
+}
+
+DFSMappedFile::DFSMappedFile() : fd(-1), data(NULL), size(0) {}
+
+DFSMappedFile::~DFSMappedFile() {
+    if (this->data != NULL) {
+        munmap(this->data, this->size);
+    }
+    if (this->fd != -1) {
+        close(this->fd);
+    }
+}
+
+std::shared_ptr<DFSMappedFile> DFSMappedFile::Open(const std::string &path) {
+    std::shared_ptr<DFSMappedFile> file(new DFSMappedFile());
+
+    file->fd = open(path.c_str(), O_RDONLY);
+    if (file->fd == -1) {
+        dfs_log(LL_ERROR) << "Failed to open " << path << " for mapping: " << strerror(errno);
+        return nullptr;
+    }
+
+    if (flock(file->fd, LOCK_SH | LOCK_NB) != 0) {
+        dfs_log(LL_ERROR) << "File is locked by a writer: " << path;
+        return nullptr;
+    }
+
+    if (fstat(file->fd, &file->snapshot) != 0) {
+        return nullptr;
+    }
+
+    file->size = file->snapshot.st_size;
+    if (file->size == 0) {
+        return file;
+    }
+
+    void *addr = mmap(NULL, file->size, PROT_READ, MAP_SHARED, file->fd, 0);
+    if (addr == MAP_FAILED) {
+        dfs_log(LL_ERROR) << "Failed to map " << path << ": " << strerror(errno);
+        return nullptr;
+    }
+    file->data = static_cast<char *>(addr);
+    madvise(file->data, file->size, MADV_SEQUENTIAL);
+
+    return file;
+}
+
+bool DFSMappedFile::Changed() const {
+    struct stat st;
+    if (fstat(this->fd, &st) != 0) {
+        return true;
+    }
+    return st.st_size != this->snapshot.st_size ||
+           st.st_mtim.tv_sec != this->snapshot.st_mtim.tv_sec ||
+           st.st_mtim.tv_nsec != this->snapshot.st_mtim.tv_nsec;
+}
+
+DFSFileLock::DFSFileLock(const std::string &path) {
+    this->fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (this->fd == -1 || flock(this->fd, LOCK_EX) != 0) {
+        dfs_log(LL_ERROR) << "Failed to lock " << path << ": " << strerror(errno);
+    }
+}
+
+DFSFileLock::~DFSFileLock() {
+    if (this->fd != -1) {
+        close(this->fd);
+    }
+}
+
+static void dfs_release_mapping(void *user_data) {
+    delete static_cast<std::shared_ptr<DFSMappedFile> *>(user_data);
+}
+
+grpc::ByteBuffer dfs_mapped_chunk(const std::shared_ptr<DFSMappedFile> &file, size_t offset, size_t length) {
+    // FileData wire format: field 5 as length-delimited, then a varint length
+    unsigned char header[16];
+    size_t header_length = 0;
+    header[header_length++] = (5 << 3) | 2;
+    size_t value = length;
+    while (value >= 0x80) {
+        header[header_length++] = static_cast<unsigned char>(value | 0x80);
+        value >>= 7;
+    }
+    header[header_length++] = static_cast<unsigned char>(value);
+
+    grpc::Slice slices[2] = {
+        grpc::Slice(header, header_length),
+        grpc::Slice(const_cast<char *>(file->Data()) + offset, length,
+                    dfs_release_mapping, new std::shared_ptr<DFSMappedFile>(file))
+    };
+    return grpc::ByteBuffer(slices, 2);
+}
@@ -7,9 +7,14 @@
 #include <cstddef>
 #include <iostream>
 #include <fstream>
+#include <chrono>
+#include <map>
+#include <memory>
 #include <sys/stat.h>
+#include <grpcpp/grpcpp.h>
 
 #include "src/dfs-utils.h"
+#include "../shared/dfs-chunk-sizer.h"
 #include "proto-src/dfs-service.grpc.pb.h"
 
 #define DFS_RESET_TIMEOUT 3000
@@ -21,4 +26,113 @@
 //
 #define BUFSIZE 4096
 
+/** Largest chunk the adaptive streamer sends (4 MB) **/
+#define DFS_MAX_CHUNK_SIZE (4 * 1024 * 1024)
+
+/** Max gRPC message size set on both ends, leaves room for the FileData framing **/
+#define DFS_MAX_MESSAGE_SIZE (DFS_MAX_CHUNK_SIZE + 64 * 1024)
+
+/** Metadata key a receiver uses to advertise the largest chunk it accepts **/
+#define DFS_CHUNK_SIZE_KEY "dfs-max-chunk-size"
+
+/**
+ * Read the chunk limit a peer advertised under DFS_CHUNK_SIZE_KEY,
+ * clamped to what this side supports.
+ *
+ * @param metadata
+ * @return size_t
+ */
+size_t dfs_peer_chunk_limit(const std::multimap<grpc::string_ref, grpc::string_ref>& metadata);
+
+/**
+ * Throughput in MB/s for logging transfer summaries
+ *
+ * @param bytes
+ * @param elapsed
+ * @return double
+ */
+double dfs_megabytes_per_second(size_t bytes, std::chrono::steady_clock::duration elapsed);
+
+/**
+ * A read-only memory mapping of a file used to serve fetches
+ * straight from the page cache.
+ *
+ * The mapping holds a shared flock on the file for as long as it
+ * lives, so writers taking a DFSFileLock wait until every in-flight
+ * fetch has released its slices instead of truncating mapped pages.
+ */
+class DFSMappedFile {
+
+private:
+    /** The open file descriptor, also carrying the shared flock **/
+    int fd;
+
+    /** Start of the mapping, NULL for an empty file **/
+    char *data;
+
+    /** Size of the file when it was mapped **/
+    size_t size;
+
+    /** The stat taken when the file was mapped **/
+    struct stat snapshot;
+
+    DFSMappedFile();
+
+public:
+    ~DFSMappedFile();
+
+    DFSMappedFile(const DFSMappedFile&) = delete;
+    DFSMappedFile& operator=(const DFSMappedFile&) = delete;
+
+    /**
+     * Map a file for reading. Returns NULL if the file cannot be opened
+     * or another process holds an exclusive lock on it.
+     *
+     * @param path
+     * @return std::shared_ptr<DFSMappedFile>
+     */
+    static std::shared_ptr<DFSMappedFile> Open(const std::string& path);
+
+    const char* Data() const { return this->data; }
+
+    size_t Size() const { return this->size; }
+
+    /**
+     * Indicates if the file changed size or mtime since it was mapped,
+     * e.g. from a writer outside the server that ignores the flock.
+     *
+     * @return bool
+     */
+    bool Changed() const;
+};
+
+/**
+ * Exclusive flock on a file held for the lifetime of the object.
+ * Writers take this before truncating a file that may be mapped.
+ */
+class DFSFileLock {
+
+private:
+    int fd;
+
+public:
+    explicit DFSFileLock(const std::string& path);
+    ~DFSFileLock();
+
+    DFSFileLock(const DFSFileLock&) = delete;
+    DFSFileLock& operator=(const DFSFileLock&) = delete;
+};
+
+/**
+ * Build a serialized FileData message whose payload slice points
+ * directly at the mapped pages, so no user-space copy is made.
+ * The slice keeps the mapping alive until gRPC releases it.
+ *
+ * @param file
+ * @param offset
+ * @param length
+ * @return grpc::ByteBuffer
+ */
+grpc::ByteBuffer dfs_mapped_chunk(const std::shared_ptr<DFSMappedFile>& file, size_t offset, size_t length);
+
 #endif
\ No newline at end of file
@@ -57,7 +57,9 @@ void DFSClient::ProcessCommand(const std::string &command, const std::string &fi
 }
 
 void DFSClient::InitializeClientNode(const std::string &server_address) {
-    this->client_node.CreateStub(grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials()));
+    grpc::ChannelArguments channel_args;
+    channel_args.SetMaxReceiveMessageSize(DFS_MAX_MESSAGE_SIZE);
+    this->client_node.CreateStub(grpc::CreateCustomChannel(server_address, grpc::InsecureChannelCredentials(), channel_args));
 }
 
 void DFSClient::SetMountPath(const std::string &path) {
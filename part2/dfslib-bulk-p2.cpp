@@ -0,0 +1,96 @@
+#include <string>
+#include <memory>
+
+#include <grpcpp/grpcpp.h>
+
+#include "dfslib-bulk-p2.h"
+
+DFSBulkServerCall::DFSBulkServerCall() : stream(&context) {}
+
+DFSBulkServerCall::~DFSBulkServerCall() {
+    void *tag;
+    bool ok;
+    this->queue.Shutdown();
+    while (this->queue.Next(&tag, &ok)) {}
+}
+
+grpc::CompletionQueue* DFSBulkServerCall::Queue() {
+    return &this->queue;
+}
+
+bool DFSBulkServerCall::Wait() {
+    void *tag;
+    bool ok = false;
+    return this->queue.Next(&tag, &ok) && ok;
+}
+
+bool DFSBulkServerCall::SendInitialMetadata() {
+    this->stream.SendInitialMetadata(this);
+    return Wait();
+}
+
+bool DFSBulkServerCall::Read(grpc::ByteBuffer *buffer) {
+    this->stream.Read(buffer, this);
+    return Wait();
+}
+
+bool DFSBulkServerCall::Write(const grpc::ByteBuffer &buffer) {
+    this->stream.Write(buffer, this);
+    return Wait();
+}
+
+void DFSBulkServerCall::Finish(const grpc::Status &status) {
+    this->stream.Finish(status, this);
+    Wait();
+}
+
+DFSBulkClientCall::DFSBulkClientCall(grpc::GenericStub *stub, grpc::ClientContext *context,
+                                     const std::string &method) {
+    this->stream = stub->PrepareCall(context, method, &this->queue);
+    this->stream->StartCall(this);
+    this->started = Wait();
+}
+
+DFSBulkClientCall::~DFSBulkClientCall() {
+    void *tag;
+    bool ok;
+    this->queue.Shutdown();
+    while (this->queue.Next(&tag, &ok)) {}
+}
+
+bool DFSBulkClientCall::Wait() {
+    void *tag;
+    bool ok = false;
+    return this->queue.Next(&tag, &ok) && ok;
+}
+
+bool DFSBulkClientCall::ReadInitialMetadata() {
+    if (!this->started) { return false; }
+    this->stream->ReadInitialMetadata(this);
+    return Wait();
+}
+
+bool DFSBulkClientCall::Read(grpc::ByteBuffer *buffer) {
+    if (!this->started) { return false; }
+    this->stream->Read(buffer, this);
+    return Wait();
+}
+
+bool DFSBulkClientCall::Write(const grpc::ByteBuffer &buffer) {
+    if (!this->started) { return false; }
+    this->stream->Write(buffer, this);
+    return Wait();
+}
+
+bool DFSBulkClientCall::WritesDone() {
+    if (!this->started) { return false; }
+    this->stream->WritesDone(this);
+    return Wait();
+}
+
+grpc::Status DFSBulkClientCall::Finish() {
+    grpc::Status status;
+    this->stream->Finish(&status, this);
+    Wait();
+    return status;
+}
@@ -0,0 +1,163 @@
+#ifndef PR4_DFSLIB_BULK_H
+#define PR4_DFSLIB_BULK_H
+
+#include <string>
+#include <memory>
+
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/generic/async_generic_service.h>
+#include <grpcpp/generic/generic_stub.h>
+
+//
+// Bulk transfers run over a generic (untyped) gRPC service, so file
+// bodies travel as raw ByteBuffer messages instead of FileData protobufs.
+//
+// Fetch: the client sends one serialized RequestFile, the server answers
+//        with raw body messages and a status.
+// Store: the client sends a serialized RequestFile header followed by raw
+//        body messages, the server answers with a serialized FileInfo.
+//
+
+/** Method name of the bulk fetch call **/
+#define DFS_BULK_FETCH_METHOD "/dfs_service.DFSBulk/FetchFile"
+
+/** Method name of the bulk store call **/
+#define DFS_BULK_STORE_METHOD "/dfs_service.DFSBulk/StoreFile"
+
+/**
+ * A server side bulk call.
+ *
+ * The call owns the completion queue its stream operations are reported
+ * on, so the thread handling the call can drive it with blocking reads
+ * and writes.
+ */
+class DFSBulkServerCall {
+
+private:
+    /** The completion queue for this call's stream operations **/
+    grpc::CompletionQueue queue;
+
+    bool Wait();
+
+public:
+    /** The call context, filled in when the call arrives **/
+    grpc::GenericServerContext context;
+
+    /** The bidirectional stream of raw messages **/
+    grpc::GenericServerAsyncReaderWriter stream;
+
+    DFSBulkServerCall();
+    ~DFSBulkServerCall();
+
+    DFSBulkServerCall(const DFSBulkServerCall&) = delete;
+    DFSBulkServerCall& operator=(const DFSBulkServerCall&) = delete;
+
+    grpc::CompletionQueue* Queue();
+
+    /**
+     * Send the initial metadata ahead of any message
+     *
+     * @return false if the call ended
+     */
+    bool SendInitialMetadata();
+
+    /**
+     * Read the next message from the client
+     *
+     * @param buffer
+     * @return false once the client is done writing or the call ended
+     */
+    bool Read(grpc::ByteBuffer* buffer);
+
+    /**
+     * Write a message to the client
+     *
+     * @param buffer
+     * @return false if the call ended
+     */
+    bool Write(const grpc::ByteBuffer& buffer);
+
+    /**
+     * End the call with the given status
+     *
+     * @param status
+     */
+    void Finish(const grpc::Status& status);
+};
+
+/**
+ * A client side bulk call, started on construction.
+ *
+ * As with the server call, each call has its own completion queue so it
+ * can be used from any client thread with blocking operations.
+ */
+class DFSBulkClientCall {
+
+private:
+    /** The completion queue for this call's stream operations **/
+    grpc::CompletionQueue queue;
+
+    /** The bidirectional stream of raw messages **/
+    std::unique_ptr<grpc::GenericClientAsyncReaderWriter> stream;
+
+    /** Whether the call was started **/
+    bool started;
+
+    bool Wait();
+
+public:
+    /**
+     * Start a bulk call
+     *
+     * @param stub
+     * @param context must outlive the call
+     * @param method
+     */
+    DFSBulkClientCall(grpc::GenericStub* stub, grpc::ClientContext* context, const std::string& method);
+    ~DFSBulkClientCall();
+
+    DFSBulkClientCall(const DFSBulkClientCall&) = delete;
+    DFSBulkClientCall& operator=(const DFSBulkClientCall&) = delete;
+
+    /**
+     * Wait for the server's initial metadata
+     *
+     * @return false if the call ended
+     */
+    bool ReadInitialMetadata();
+
+    bool Read(grpc::ByteBuffer* buffer);
+    bool Write(const grpc::ByteBuffer& buffer);
+    bool WritesDone();
+    grpc::Status Finish();
+};
+
+/**
+ * Serialize a protobuf message into a buffer for a bulk call
+ *
+ * @tparam MessageT
+ * @param message
+ * @return grpc::ByteBuffer
+ */
+template <typename MessageT>
+grpc::ByteBuffer dfs_bulk_serialize(const MessageT& message) {
+    grpc::ByteBuffer buffer;
+    bool own_buffer;
+    grpc::SerializationTraits<MessageT>::Serialize(message, &buffer, &own_buffer);
+    return buffer;
+}
+
+/**
+ * Parse a protobuf message out of a bulk call buffer
+ *
+ * @tparam MessageT
+ * @param buffer
+ * @param message
+ * @return bool
+ */
+template <typename MessageT>
+bool dfs_bulk_parse(grpc::ByteBuffer* buffer, MessageT* message) {
+    return grpc::SerializationTraits<MessageT>::Deserialize(buffer, message).ok();
+}
+
+#endif
@@ -0,0 +1,263 @@
+#include <array>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include "dfslib-shared-p2.h"
+#include "dfslib-chunks-p2.h"
+
+// Normalized chunking masks for an 8 KB average: harder to match before
+// the average size, easier after it. The bits are spread over the high
+// end of the hash so each decision depends on a wide window of bytes.
+static const std::uint64_t DFS_CDC_MASK_SMALL = 0x0003590703530000ULL;
+static const std::uint64_t DFS_CDC_MASK_LARGE = 0x0000d90003530000ULL;
+
+static std::array<std::uint64_t, 256> dfs_gear_table() {
+    // Fixed pseudo-random values from splitmix64, so every build cuts alike
+    std::array<std::uint64_t, 256> table;
+    std::uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for (std::uint64_t &value : table) {
+        std::uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        value = z ^ (z >> 31);
+    }
+    return table;
+}
+
+static const std::array<std::uint64_t, 256> DFS_GEAR = dfs_gear_table();
+
+size_t dfs_cdc_cut(const char *data, size_t size) {
+    if (size <= DFS_CDC_MIN_CHUNK) {
+        return size;
+    }
+
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    size_t end = std::min<size_t>(size, DFS_CDC_MAX_CHUNK);
+    size_t normal = std::min<size_t>(end, DFS_CDC_AVG_CHUNK);
+    std::uint64_t hash = 0;
+    size_t i = DFS_CDC_MIN_CHUNK;
+
+    for (; i < normal; i++) {
+        hash = (hash << 1) + DFS_GEAR[bytes[i]];
+        if ((hash & DFS_CDC_MASK_SMALL) == 0) {
+            return i;
+        }
+    }
+    for (; i < end; i++) {
+        hash = (hash << 1) + DFS_GEAR[bytes[i]];
+        if ((hash & DFS_CDC_MASK_LARGE) == 0) {
+            return i;
+        }
+    }
+    return end;
+}
+
+bool dfs_cdc_file_chunks(const DFSReadFile &file,
+                         const std::function<void(size_t, const char *, size_t)> &chunk) {
+    // A cut looks at most DFS_CDC_MAX_CHUNK bytes ahead, so a window that
+    // still holds that much past the current offset cuts like the whole file
+    std::vector<char> window(std::min<size_t>(file.Size(), DFS_CDC_WINDOW));
+    size_t window_start = 0, window_length = 0;
+    size_t offset = 0;
+    while (offset < file.Size()) {
+        size_t window_end = window_start + window_length;
+        if (window_end < file.Size() && window_end - offset < DFS_CDC_MAX_CHUNK) {
+            size_t kept = window_end - offset;
+            std::memmove(window.data(), window.data() + (offset - window_start), kept);
+            window_start = offset;
+            window_length = std::min(window.size(), file.Size() - offset);
+            if (!file.Read(window_end, window_length - kept, window.data() + kept)) {
+                return false;
+            }
+        }
+
+        const char *data = window.data() + (offset - window_start);
+        size_t length = dfs_cdc_cut(data, window_start + window_length - offset);
+        chunk(offset, data, length);
+        offset += length;
+    }
+    return true;
+}
+
+std::string dfs_chunk_id(const char *data, size_t length) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length = 0;
+    EVP_Digest(data, length, digest, &digest_length, EVP_sha256(), NULL);
+    return std::string(reinterpret_cast<char *>(digest), digest_length);
+}
+
+DFSChunkIndex::DFSChunkIndex(const std::string &mount_path) :
+    mount_path(mount_path), total_bytes(0), unique_bytes(0), stopping(false) {
+    this->thread = std::thread(&DFSChunkIndex::Run, this);
+}
+
+DFSChunkIndex::~DFSChunkIndex() {
+    {
+        std::lock_guard<std::mutex> lock(this->index_mutex);
+        this->stopping = true;
+    }
+    this->queued_cv.notify_all();
+    if (this->thread.joinable()) {
+        this->thread.join();
+    }
+}
+
+bool DFSChunkIndex::AddFile(const std::string &file_name) {
+    std::shared_ptr<DFSReadFile> file = DFSReadFile::Open(this->mount_path + file_name);
+    std::vector<std::pair<std::string, size_t>> entries;
+
+    // Hash outside the lock; reads check the hash again, so a file changed
+    // while it is hashed at worst leaves entries that are never served
+    if (!file || !dfs_cdc_file_chunks(*file, [&](size_t offset, const char *data, size_t length) {
+            entries.push_back({dfs_chunk_id(data, length), length});
+        })) {
+        RemoveFile(file_name);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(this->index_mutex);
+
+    // A store that replaced the file meanwhile has indexed, or queued, the new copy
+    std::shared_ptr<DFSReadFile> current = DFSReadFile::Open(this->mount_path + file_name);
+    if (!current || current->Version() != file->Version()) {
+        return false;
+    }
+    SetLocked(file_name, entries);
+    return true;
+}
+
+void DFSChunkIndex::QueueFile(const std::string &file_name) {
+    {
+        std::lock_guard<std::mutex> lock(this->index_mutex);
+        this->queued.insert(file_name);
+    }
+    this->queued_cv.notify_one();
+}
+
+void DFSChunkIndex::SetFile(const std::string &file_name,
+                            const std::vector<std::pair<std::string, size_t>> &chunks) {
+    std::lock_guard<std::mutex> lock(this->index_mutex);
+    this->queued.erase(file_name);
+    SetLocked(file_name, chunks);
+}
+
+void DFSChunkIndex::SetLocked(const std::string &file_name,
+                              const std::vector<std::pair<std::string, size_t>> &chunks) {
+    RemoveLocked(file_name);
+
+    std::vector<std::string> &ids = this->files[file_name];
+    size_t offset = 0;
+    for (const auto &chunk : chunks) {
+        std::vector<DFSChunkLocation> &locations = this->chunks[chunk.first];
+        if (locations.empty()) {
+            this->unique_bytes += chunk.second;
+        }
+        locations.push_back({file_name, offset, chunk.second});
+        ids.push_back(chunk.first);
+        offset += chunk.second;
+    }
+    this->total_bytes += offset;
+}
+
+void DFSChunkIndex::Run() {
+    std::unique_lock<std::mutex> lock(this->index_mutex);
+    while (!this->stopping) {
+        if (this->queued.empty()) {
+            this->queued_cv.wait(lock);
+            continue;
+        }
+
+        std::string file_name = *this->queued.begin();
+        this->queued.erase(this->queued.begin());
+        lock.unlock();
+        AddFile(file_name);
+        lock.lock();
+    }
+}
+
+void DFSChunkIndex::RemoveFile(const std::string &file_name) {
+    std::lock_guard<std::mutex> lock(this->index_mutex);
+    RemoveLocked(file_name);
+}
+
+void DFSChunkIndex::RemoveLocked(const std::string &file_name) {
+    auto file_iter = this->files.find(file_name);
+    if (file_iter == this->files.end()) {
+        return;
+    }
+
+    for (const std::string &id : file_iter->second) {
+        auto chunk_iter = this->chunks.find(id);
+        if (chunk_iter == this->chunks.end()) {
+            continue;
+        }
+
+        std::vector<DFSChunkLocation> &locations = chunk_iter->second;
+        auto location = std::find_if(locations.begin(), locations.end(),
+                                     [&](const DFSChunkLocation &l) { return l.file_name == file_name; });
+        if (location == locations.end()) {
+            continue;
+        }
+        this->total_bytes -= location->length;
+        size_t length = location->length;
+        locations.erase(location);
+        if (locations.empty()) {
+            this->unique_bytes -= length;
+            this->chunks.erase(chunk_iter);
+        }
+    }
+    this->files.erase(file_iter);
+}
+
+bool DFSChunkIndex::Has(const std::string &id) {
+    std::lock_guard<std::mutex> lock(this->index_mutex);
+    return this->chunks.count(id) > 0;
+}
+
+bool DFSChunkIndex::Read(const std::string &id, std::string *data) {
+    std::vector<DFSChunkLocation> locations;
+    {
+        std::lock_guard<std::mutex> lock(this->index_mutex);
+        auto chunk_iter = this->chunks.find(id);
+        if (chunk_iter == this->chunks.end()) {
+            return false;
+        }
+        locations = chunk_iter->second;
+    }
+
+    for (const DFSChunkLocation &location : locations) {
+        int fd = open((this->mount_path + location.file_name).c_str(), O_RDONLY);
+        if (fd == -1) {
+            continue;
+        }
+        data->resize(location.length);
+        ssize_t read_size = pread(fd, &(*data)[0], location.length, location.offset);
+        close(fd);
+        if (read_size == static_cast<ssize_t>(location.length) && dfs_chunk_id(data->data(), data->size()) == id) {
+            return true;
+        }
+        dfs_log(LL_DEBUG) << "Stale chunk entry in " << location.file_name << " at " << location.offset;
+    }
+    return false;
+}
+
+std::string DFSChunkIndex::Stats() {
+    std::lock_guard<std::mutex> lock(this->index_mutex);
+    std::stringstream stats;
+    stats << this->files.size() << " files, " << this->chunks.size() << " unique chunks, "
+          << this->unique_bytes << " of " << this->total_bytes << " bytes unique, dedup ratio "
+          << (this->unique_bytes > 0 ? static_cast<double>(this->total_bytes) / this->unique_bytes : 1.0);
+    return stats.str();
+}
@@ -0,0 +1,192 @@
+#ifndef PR4_DFSLIB_CHUNKS_H
+#define PR4_DFSLIB_CHUNKS_H
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <utility>
+#include <functional>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "dfslib-shared-p2.h"
+
+//
+// Content-defined chunking.
+//
+// Files are cut where a Gear hash of the preceding bytes matches a mask
+// (FastCDC with normalized chunking), so an insert or delete only moves
+// the boundaries next to it. Chunks are named by their SHA-256, which
+// lets the server recognise data it already holds in any file.
+//
+
+/** Chunk size bounds and target **/
+#define DFS_CDC_MIN_CHUNK (2*1024)
+#define DFS_CDC_AVG_CHUNK (8*1024)
+#define DFS_CDC_MAX_CHUNK (64*1024)
+
+/** Bytes of a file read at a time while cutting it into chunks **/
+#define DFS_CDC_WINDOW (1024*1024)
+
+/** Files smaller than this are stored whole, dedup would save less than its extra round-trip **/
+#define DFS_CHUNKED_MIN_SIZE (1024*1024)
+
+/** Number of chunk IDs asked about in one HaveChunks call **/
+#define DFS_CHUNK_QUERY_BATCH 4096
+
+/**
+ * Length of the chunk starting at `data`
+ *
+ * @param data
+ * @param size bytes left in the file
+ * @return size_t
+ */
+size_t dfs_cdc_cut(const char* data, size_t size);
+
+/**
+ * Cut a file into chunks, reading it a window at a time
+ *
+ * @param file
+ * @param chunk called with the offset, bytes and length of each chunk in order
+ * @return bool false if the file could not be read to the end
+ */
+bool dfs_cdc_file_chunks(const DFSReadFile& file,
+                         const std::function<void(size_t, const char*, size_t)>& chunk);
+
+/**
+ * The ID of a chunk, its raw SHA-256
+ *
+ * @param data
+ * @param length
+ * @return std::string
+ */
+std::string dfs_chunk_id(const char* data, size_t length);
+
+/** Where a chunk can be read from in the mount **/
+struct DFSChunkLocation {
+    std::string file_name;
+    size_t offset;
+    size_t length;
+};
+
+/**
+ * Index of the chunks of every file in the server mount.
+ *
+ * Files stay whole in the mount, the index only records where each chunk
+ * can be found, so uploads can reuse data the server already has. Reads
+ * check the chunk's hash, so an entry made stale by a change outside the
+ * server is never served.
+ *
+ * A chunked upload already names its chunks, so it is indexed from the
+ * list it was rebuilt from. Any other upload is queued and hashed on the
+ * index's own thread, so a store never waits for its file to be read back.
+ */
+class DFSChunkIndex {
+
+private:
+    /** The mount the indexed files live in **/
+    std::string mount_path;
+
+    /** Guards the maps and counters below **/
+    std::mutex index_mutex;
+
+    /** Every known location of each chunk **/
+    std::unordered_map<std::string, std::vector<DFSChunkLocation>> chunks;
+
+    /** The chunks of each indexed file **/
+    std::map<std::string, std::vector<std::string>> files;
+
+    /** Size of all indexed files together **/
+    size_t total_bytes;
+
+    /** Size of the distinct chunks among them **/
+    size_t unique_bytes;
+
+    /** Files waiting for the indexing thread, guarded by the index mutex **/
+    std::set<std::string> queued;
+
+    std::condition_variable queued_cv;
+
+    bool stopping;
+
+    std::thread thread;
+
+    void RemoveLocked(const std::string& file_name);
+
+    /**
+     * Replace the entries of a file with the chunks it holds, in file order;
+     * the index mutex must be held
+     *
+     * @param file_name
+     * @param chunks the ID and length of each chunk
+     */
+    void SetLocked(const std::string& file_name, const std::vector<std::pair<std::string, size_t>>& chunks);
+
+    void Run();
+
+public:
+    explicit DFSChunkIndex(const std::string& mount_path);
+
+    ~DFSChunkIndex();
+
+    /**
+     * Index the current contents of a file, replacing its old entries
+     *
+     * @param file_name
+     * @return bool false if the file could not be read, or was replaced while it was read
+     */
+    bool AddFile(const std::string& file_name);
+
+    /**
+     * Index a file on the index's thread, off the caller's path
+     *
+     * @param file_name
+     */
+    void QueueFile(const std::string& file_name);
+
+    /**
+     * Index a file from the chunks it was just rebuilt from, without
+     * reading it back
+     *
+     * @param file_name
+     * @param chunks the ID and length of each chunk, in file order
+     */
+    void SetFile(const std::string& file_name, const std::vector<std::pair<std::string, size_t>>& chunks);
+
+    /**
+     * Drop the entries of a deleted file
+     *
+     * @param file_name
+     */
+    void RemoveFile(const std::string& file_name);
+
+    /**
+     * Indicates if a chunk is held in some file
+     *
+     * @param id
+     * @return bool
+     */
+    bool Has(const std::string& id);
+
+    /**
+     * Read a chunk from any file holding it
+     *
+     * @param id
+     * @param data
+     * @return bool false if no file still holds it
+     */
+    bool Read(const std::string& id, std::string* data);
+
+    /**
+     * One-line summary of the index and its dedup ratio, for logging
+     *
+     * @return std::string
+     */
+    std::string Stats();
+};
+
+#endif
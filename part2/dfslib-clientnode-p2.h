@@ -7,6 +7,7 @@
 #include <limits.h>
 #include <chrono>
 #include <mutex>
+#include <atomic>
 
 #include <grpcpp/grpcpp.h>
 
@@ -44,6 +45,14 @@ public:
      */
     grpc::StatusCode RequestWriteAccess(const std::string& filename) override ;
 
+    /**
+     * Extend the lease of a write lock this client holds
+     *
+     * @param filename
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode RenewWriteAccess(const std::string& filename);
+
     /**
      * Store a file from the mount path on to the RPC server
      *
@@ -142,6 +151,118 @@ public:
     // You may add any additional declarations of methods or variables that you need here.
     //
 
+private:
+
+    /** Lease of the last write lock granted, 0 if the server did not say **/
+    std::atomic<long> lease_ms;
+
+    /**
+     * Store a file over a bulk transfer call
+     *
+     * @param header
+     * @param file_path
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode StoreBulk(const dfs_service::RequestFile& header, const std::string& file_path);
+
+    /**
+     * Store a file as a delta against the server's copy
+     *
+     * @param header
+     * @param file_path
+     * @return grpc::StatusCode DATA_LOSS if the server rebuilt a different file
+     */
+    grpc::StatusCode StoreDelta(const dfs_service::RequestFile& header, const std::string& file_path);
+
+    /**
+     * Store a file as content-defined chunks, sending only the chunks
+     * the server does not hold yet
+     *
+     * @param header
+     * @param file_path
+     * @return grpc::StatusCode DATA_LOSS or FAILED_PRECONDITION if the server could not rebuild the file
+     */
+    grpc::StatusCode StoreChunked(const dfs_service::RequestFile& header, const std::string& file_path);
+
+    /**
+     * Fetch a file over a bulk transfer call
+     *
+     * @param request_file
+     * @param file_path
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode FetchBulk(const dfs_service::RequestFile& request_file, const std::string& file_path);
+
+    /**
+     * Store a file as stripes sent over concurrent streams, then commit it
+     *
+     * @param header
+     * @param file_path
+     * @param file_size
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode StoreStriped(const dfs_service::RequestFile& header, const std::string& file_path, size_t file_size);
+
+    /**
+     * Send one StoreFile call for the range in `header`, read from `fd`.
+     * `on_accept` runs once the server has accepted the header.
+     *
+     * @param header
+     * @param fd
+     * @param on_accept
+     * @param file_info
+     * @return grpc::Status
+     */
+    grpc::Status StoreStripe(const dfs_service::RequestFile& header, int fd,
+                             const std::function<void()>& on_accept, dfs_service::FileInfo* file_info);
+
+    /**
+     * Fetch a file as stripes received over concurrent streams
+     *
+     * @param request_file
+     * @param file_path
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode FetchStriped(const dfs_service::RequestFile& request_file, const std::string& file_path);
+
+    /**
+     * Write the messages of a fetch stream to `fd` starting at `offset`,
+     * then finish the call and check the stripe against the server's CRC
+     *
+     * @param context
+     * @param client_reader
+     * @param fd
+     * @param offset
+     * @param stripe_crc set to the CRC of the bytes received
+     * @param stripe_bytes set to the number of bytes received
+     * @return grpc::Status
+     */
+    grpc::Status ReceiveStripe(grpc::ClientContext* context, grpc::ClientReader<dfs_service::FileData>* client_reader,
+                               int fd, size_t offset, std::uint32_t* stripe_crc, size_t* stripe_bytes);
+
+    /**
+     * Queue the syncs that bring the mount in line with a listing from the
+     * server, and remember its version for the next one
+     *
+     * @param file_list
+     */
+    void ApplyListing(const dfs_service::FileList& file_list);
+
+    /**
+     * Fetch or store one file of a listing, whichever copy is older;
+     * runs on the sync pool
+     *
+     * @param file_info_from_server
+     */
+    void SyncFromServer(const dfs_service::FileInfo& file_info_from_server);
+
+    /**
+     * Apply the listings the server streams as its files change, until
+     * the stream ends
+     *
+     * @return grpc::StatusCode UNIMPLEMENTED if the server can't stream them
+     */
+    grpc::StatusCode WatchChanges();
 
 };
 #endif
@@ -0,0 +1,316 @@
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <sstream>
+#include <fstream>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define DFS_CRC32C_X86
+#endif
+
+#include "dfslib-shared-p2.h"
+#include "dfslib-crc-p2.h"
+
+// Reflected Castagnoli polynomial
+static const std::uint32_t DFS_CRC32C_POLY = 0x82f63b78;
+
+typedef std::array<std::array<std::uint32_t, 256>, 16> DFSCrcTables;
+
+static DFSCrcTables dfs_crc32c_tables() {
+    // Table k advances a byte through k further zero bytes, so sixteen
+    // lookups fold a 16-byte block in one step
+    DFSCrcTables tables;
+    for (std::uint32_t i = 0; i < 256; i++) {
+        std::uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (DFS_CRC32C_POLY & (0 - (crc & 1)));
+        }
+        tables[0][i] = crc;
+    }
+    for (std::uint32_t i = 0; i < 256; i++) {
+        for (size_t k = 1; k < tables.size(); k++) {
+            tables[k][i] = (tables[k - 1][i] >> 8) ^ tables[0][tables[k - 1][i] & 0xff];
+        }
+    }
+    return tables;
+}
+
+static const DFSCrcTables DFS_CRC32C_TABLES = dfs_crc32c_tables();
+
+static inline std::uint32_t dfs_load32(const unsigned char *bytes) {
+    return static_cast<std::uint32_t>(bytes[0]) | static_cast<std::uint32_t>(bytes[1]) << 8 |
+           static_cast<std::uint32_t>(bytes[2]) << 16 | static_cast<std::uint32_t>(bytes[3]) << 24;
+}
+
+std::uint32_t dfs_crc32c_portable(const char *data, size_t size, std::uint32_t crc) {
+    const DFSCrcTables &t = DFS_CRC32C_TABLES;
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    crc = ~crc;
+
+    while (size >= 16) {
+        std::uint32_t one = dfs_load32(bytes) ^ crc;
+        std::uint32_t two = dfs_load32(bytes + 4);
+        std::uint32_t three = dfs_load32(bytes + 8);
+        std::uint32_t four = dfs_load32(bytes + 12);
+        crc = t[15][one & 0xff] ^ t[14][(one >> 8) & 0xff] ^ t[13][(one >> 16) & 0xff] ^ t[12][one >> 24] ^
+              t[11][two & 0xff] ^ t[10][(two >> 8) & 0xff] ^ t[9][(two >> 16) & 0xff] ^ t[8][two >> 24] ^
+              t[7][three & 0xff] ^ t[6][(three >> 8) & 0xff] ^ t[5][(three >> 16) & 0xff] ^ t[4][three >> 24] ^
+              t[3][four & 0xff] ^ t[2][(four >> 8) & 0xff] ^ t[1][(four >> 16) & 0xff] ^ t[0][four >> 24];
+        bytes += 16;
+        size -= 16;
+    }
+    while (size-- > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *bytes++) & 0xff];
+    }
+    return ~crc;
+}
+
+#ifdef DFS_CRC32C_X86
+__attribute__((target("sse4.2")))
+static std::uint32_t dfs_crc32c_sse42(const char *data, size_t size, std::uint32_t crc) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    crc = ~crc;
+
+#ifdef __x86_64__
+    std::uint64_t crc64 = crc;
+    for (; size >= 8; bytes += 8, size -= 8) {
+        std::uint64_t word;
+        std::memcpy(&word, bytes, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = static_cast<std::uint32_t>(crc64);
+#endif
+    for (; size >= 4; bytes += 4, size -= 4) {
+        std::uint32_t word;
+        std::memcpy(&word, bytes, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+    }
+    while (size-- > 0) {
+        crc = _mm_crc32_u8(crc, *bytes++);
+    }
+    return ~crc;
+}
+#endif
+
+typedef std::uint32_t (*DFSCrcKernel)(const char *, size_t, std::uint32_t);
+
+static DFSCrcKernel dfs_crc32c_select(const char **name) {
+#ifdef DFS_CRC32C_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        *name = "sse4.2";
+        return dfs_crc32c_sse42;
+    }
+#endif
+    *name = "slice-by-16";
+    return dfs_crc32c_portable;
+}
+
+static const char *dfs_crc32c_name = NULL;
+
+static const DFSCrcKernel dfs_crc32c_kernel = dfs_crc32c_select(&dfs_crc32c_name);
+
+std::uint32_t dfs_crc32c(const char *data, size_t size, std::uint32_t crc) {
+    return dfs_crc32c_kernel(data, size, crc);
+}
+
+// Multiply a vector by a 32x32 matrix over GF(2), one column per bit
+static std::uint32_t dfs_gf2_times(const std::uint32_t *matrix, std::uint32_t vector) {
+    std::uint32_t sum = 0;
+    for (; vector != 0; vector >>= 1, matrix++) {
+        if (vector & 1) {
+            sum ^= *matrix;
+        }
+    }
+    return sum;
+}
+
+static void dfs_gf2_square(std::uint32_t *square, const std::uint32_t *matrix) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = dfs_gf2_times(matrix, matrix[n]);
+    }
+}
+
+std::uint32_t dfs_crc32c_combine(std::uint32_t first_crc, std::uint32_t second_crc, size_t second_size) {
+    if (second_size == 0) {
+        return first_crc;
+    }
+
+    // Feeding the first CRC through second_size zero bytes lines it up with
+    // the second; the operator for one zero bit is squared up to bytes and
+    // then applied for every set bit of the size
+    std::uint32_t even[32];
+    std::uint32_t odd[32];
+    odd[0] = DFS_CRC32C_POLY;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = 1u << (n - 1);
+    }
+    dfs_gf2_square(even, odd);
+    dfs_gf2_square(odd, even);
+
+    while (true) {
+        dfs_gf2_square(even, odd);
+        if (second_size & 1) {
+            first_crc = dfs_gf2_times(even, first_crc);
+        }
+        second_size >>= 1;
+        if (second_size == 0) {
+            break;
+        }
+        dfs_gf2_square(odd, even);
+        if (second_size & 1) {
+            first_crc = dfs_gf2_times(odd, first_crc);
+        }
+        second_size >>= 1;
+        if (second_size == 0) {
+            break;
+        }
+    }
+    return first_crc ^ second_crc;
+}
+
+const char *dfs_crc32c_engine() {
+    return dfs_crc32c_name;
+}
+
+std::uint32_t dfs_file_checksum(const std::string &filepath) {
+    struct stat st;
+    if (lstat(filepath.c_str(), &st) != 0) {
+        return 0;
+    }
+
+    std::shared_ptr<DFSReadFile> file = DFSReadFile::Open(filepath);
+    if (!file) {
+        return 0;
+    }
+
+    std::vector<char> buffer(std::min<size_t>(file->Size(), DFS_MAX_CHUNK_SIZE));
+    std::uint32_t crc = 0;
+    for (size_t offset = 0; offset < file->Size(); offset += buffer.size()) {
+        size_t length = std::min(buffer.size(), file->Size() - offset);
+        if (!file->Read(offset, length, buffer.data())) {
+            return 0;
+        }
+        crc = dfs_crc32c(buffer.data(), length, crc);
+    }
+    return crc;
+}
+
+DFSChecksumCache::DFSChecksumCache() : hits(0), misses(0), bytes_avoided(0) {}
+
+bool DFSChecksumCache::Persist(const std::string &sidecar_path) {
+    std::lock_guard<std::mutex> lock(this->cache_mutex);
+    this->sidecar_path = sidecar_path;
+
+    // Later lines for a path replace earlier ones, the sidecar is only appended to
+    bool loaded = true;
+    std::ifstream ifs(sidecar_path);
+    if (ifs.is_open()) {
+        Entry entry;
+        std::string file_path;
+        while (ifs >> entry.inode >> entry.size >> entry.mtime_ns >> entry.crc && ifs.get() == ' ' &&
+               std::getline(ifs, file_path)) {
+            this->entries[file_path] = entry;
+        }
+        loaded = ifs.eof();
+        dfs_log(LL_SYSINFO) << "Loaded " << this->entries.size() << " checksums from " << sidecar_path;
+    }
+    return SaveLocked() && loaded;
+}
+
+std::uint32_t DFSChecksumCache::Checksum(const std::string &file_path) {
+    struct stat st;
+    if (lstat(file_path.c_str(), &st) != 0) {
+        return 0;
+    }
+    std::int64_t mtime_ns = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+
+    {
+        std::lock_guard<std::mutex> lock(this->cache_mutex);
+        auto entry_iter = this->entries.find(file_path);
+        if (entry_iter != this->entries.end() && entry_iter->second.inode == st.st_ino &&
+                entry_iter->second.size == st.st_size && entry_iter->second.mtime_ns == mtime_ns) {
+            this->hits++;
+            this->bytes_avoided += st.st_size;
+            return entry_iter->second.crc;
+        }
+    }
+
+    // Checksum outside the lock; the entry is keyed by the stat taken
+    // before the read, so a write racing with it only causes a later miss
+    std::uint32_t crc = dfs_file_checksum(file_path);
+
+    std::lock_guard<std::mutex> lock(this->cache_mutex);
+    this->misses++;
+    Entry &entry = this->entries[file_path];
+    entry = {st.st_ino, st.st_size, mtime_ns, crc};
+    AppendLocked(file_path, entry);
+    return crc;
+}
+
+void DFSChecksumCache::Put(const std::string &file_path, std::uint32_t crc) {
+    struct stat st;
+    if (lstat(file_path.c_str(), &st) != 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(this->cache_mutex);
+    Entry &entry = this->entries[file_path];
+    entry = {st.st_ino, st.st_size, static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec, crc};
+    AppendLocked(file_path, entry);
+}
+
+void DFSChecksumCache::Invalidate(const std::string &file_path) {
+    std::lock_guard<std::mutex> lock(this->cache_mutex);
+    this->entries.erase(file_path);
+}
+
+bool DFSChecksumCache::SaveLocked() {
+    if (this->sidecar_path.empty()) {
+        return true;
+    }
+    this->sidecar.close();
+
+    // Replace the old sidecar in one step, so a crash mid-write leaves one intact
+    std::string tmp_path = this->sidecar_path + ".tmp";
+    {
+        std::ofstream ofs(tmp_path, std::ios::trunc);
+        for (const auto &entry : this->entries) {
+            ofs << entry.second.inode << " " << entry.second.size << " " << entry.second.mtime_ns << " "
+                << entry.second.crc << " " << entry.first << "\n";
+        }
+        if (!ofs) {
+            dfs_log(LL_ERROR) << "Failed to save checksums to " << tmp_path;
+            return false;
+        }
+    }
+    bool saved = rename(tmp_path.c_str(), this->sidecar_path.c_str()) == 0;
+    this->sidecar.open(this->sidecar_path, std::ios::app);
+    return saved;
+}
+
+void DFSChecksumCache::AppendLocked(const std::string &file_path, const Entry &entry) {
+    if (!this->sidecar.is_open()) {
+        return;
+    }
+    // One line per checksum, flushed so it survives the server being killed
+    this->sidecar << entry.inode << " " << entry.size << " " << entry.mtime_ns << " "
+                  << entry.crc << " " << file_path << std::endl;
+}
+
+std::string DFSChecksumCache::Stats() {
+    std::lock_guard<std::mutex> lock(this->cache_mutex);
+    size_t lookups = this->hits + this->misses;
+    std::stringstream stats;
+    stats << this->hits << " of " << lookups << " checksums cached ("
+          << (lookups > 0 ? 100.0 * this->hits / lookups : 0.0) << "% hit rate), "
+          << this->bytes_avoided << " bytes of reads avoided";
+    return stats.str();
+}
@@ -0,0 +1,154 @@
+#ifndef PR4_DFSLIB_CRC_H
+#define PR4_DFSLIB_CRC_H
+
+#include <mutex>
+#include <string>
+#include <fstream>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <sys/types.h>
+
+//
+// CRC-32C (Castagnoli) checksums.
+//
+// The kernel is picked once at startup: the SSE4.2 crc32 instruction when
+// the CPU has it, otherwise a slice-by-16 table walk that consumes 16 bytes
+// per step instead of CRCpp's one.
+//
+
+/**
+ * Extend a CRC-32C over more data. Passing the result of the previous call
+ * as `crc` checksums a stream piece by piece; 0 starts a new checksum.
+ *
+ * @param data
+ * @param size
+ * @param crc
+ * @return std::uint32_t
+ */
+std::uint32_t dfs_crc32c(const char* data, size_t size, std::uint32_t crc = 0);
+
+/**
+ * The CRC-32C of two pieces of data joined together, from the CRC of each
+ * piece and the size of the second, without reading the data again
+ *
+ * @param first_crc
+ * @param second_crc
+ * @param second_size
+ * @return std::uint32_t
+ */
+std::uint32_t dfs_crc32c_combine(std::uint32_t first_crc, std::uint32_t second_crc, size_t second_size);
+
+/**
+ * The slice-by-16 kernel, used when the CPU lacks SSE4.2
+ *
+ * @param data
+ * @param size
+ * @param crc
+ * @return std::uint32_t
+ */
+std::uint32_t dfs_crc32c_portable(const char* data, size_t size, std::uint32_t crc = 0);
+
+/**
+ * Name of the kernel dfs_crc32c runs, for logging
+ *
+ * @return const char*
+ */
+const char* dfs_crc32c_engine();
+
+/**
+ * Calculate the checksum of a file, 0 if it cannot be read
+ *
+ * @param filepath
+ * @return std::uint32_t
+ */
+std::uint32_t dfs_file_checksum(const std::string& filepath);
+
+/** Name of the checksum cache sidecar kept in a mount **/
+#define DFS_CHECKSUM_CACHE_NAME ".dfs-checksums"
+
+/**
+ * File checksums remembered by inode, size and mtime, so a file that did
+ * not change since it was last checksummed is not read again.
+ *
+ * The cache can be persisted to a sidecar file, which makes the checksums
+ * survive a restart. New checksums are appended to it as they are taken and
+ * the file is compacted when loaded; a stale entry simply fails the stat check.
+ */
+class DFSChecksumCache {
+
+private:
+    /** The stat a checksum was taken at **/
+    struct Entry {
+        ino_t inode;
+        off_t size;
+        std::int64_t mtime_ns;
+        std::uint32_t crc;
+    };
+
+    /** Guards the entries and counters below **/
+    std::mutex cache_mutex;
+
+    /** Checksums by file path **/
+    std::unordered_map<std::string, Entry> entries;
+
+    /** Where the cache is saved, empty to keep it in memory only **/
+    std::string sidecar_path;
+
+    /** Open for appending new checksums to the sidecar **/
+    std::ofstream sidecar;
+
+    size_t hits;
+    size_t misses;
+
+    /** File bytes the hits did not have to read **/
+    size_t bytes_avoided;
+
+    bool SaveLocked();
+
+    void AppendLocked(const std::string& file_path, const Entry& entry);
+
+public:
+    DFSChecksumCache();
+
+    /**
+     * Load the checksums saved in a sidecar and save new ones to it
+     *
+     * @param sidecar_path
+     * @return bool false if an existing sidecar could not be read
+     */
+    bool Persist(const std::string& sidecar_path);
+
+    /**
+     * The checksum of a file, read from disk only if the file changed
+     *
+     * @param file_path
+     * @return std::uint32_t 0 if the file cannot be read
+     */
+    std::uint32_t Checksum(const std::string& file_path);
+
+    /**
+     * Record the checksum of a file just written, taken over its bytes as
+     * they arrived, so it is not read back to checksum it
+     *
+     * @param file_path
+     * @param crc
+     */
+    void Put(const std::string& file_path, std::uint32_t crc);
+
+    /**
+     * Forget the checksum of a file that was replaced or deleted
+     *
+     * @param file_path
+     */
+    void Invalidate(const std::string& file_path);
+
+    /**
+     * One-line summary of the hit rate and reads avoided, for logging
+     *
+     * @return std::string
+     */
+    std::string Stats();
+};
+
+#endif
@@ -0,0 +1,295 @@
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+
+#include <openssl/evp.h>
+
+#include "dfslib-delta-p2.h"
+
+using dfs_service::BlockRun;
+using dfs_service::DeltaRequest;
+using dfs_service::SignatureList;
+
+DFSRollingChecksum::DFSRollingChecksum() : a(0), b(0), length(0) {}
+
+void DFSRollingChecksum::Reset(const char *data, size_t length) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    this->a = 0;
+    this->b = 0;
+    this->length = length;
+    for (size_t i = 0; i < length; i++) {
+        this->a += bytes[i];
+        this->b += static_cast<std::uint32_t>(length - i) * bytes[i];
+    }
+}
+
+void DFSRollingChecksum::Roll(unsigned char out, unsigned char in) {
+    this->a += in - out;
+    this->b += this->a - static_cast<std::uint32_t>(this->length) * out;
+}
+
+std::uint32_t DFSRollingChecksum::Value() const {
+    return (this->a & 0xffff) | (this->b << 16);
+}
+
+size_t dfs_delta_block_size(size_t file_size) {
+    size_t block_size = static_cast<size_t>(std::sqrt(static_cast<double>(file_size)));
+    block_size = (block_size + 1023) & ~static_cast<size_t>(1023);
+    return std::max<size_t>(DFS_DELTA_MIN_BLOCK, std::min<size_t>(block_size, DFS_DELTA_MAX_BLOCK));
+}
+
+std::string dfs_strong_checksum(const char *data, size_t length) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length = 0;
+    EVP_Digest(data, length, digest, &digest_length, EVP_md5(), NULL);
+    return std::string(reinterpret_cast<char *>(digest), digest_length);
+}
+
+bool dfs_block_signatures(const DFSReadFile &file, SignatureList *signatures) {
+    size_t size = file.Size();
+    size_t block_size = dfs_delta_block_size(size);
+    signatures->set_block_size(block_size);
+    signatures->set_file_size(size);
+
+    std::vector<char> block(std::min(block_size, size));
+    DFSRollingChecksum weak;
+    for (size_t offset = 0; offset < size; offset += block_size) {
+        size_t length = std::min(block_size, size - offset);
+        if (!file.Read(offset, length, block.data())) {
+            return false;
+        }
+        weak.Reset(block.data(), length);
+        dfs_service::BlockSignature *signature = signatures->add_blocks();
+        signature->set_weak(weak.Value());
+        signature->set_strong(dfs_strong_checksum(block.data(), length));
+    }
+    return true;
+}
+
+/**
+ * The stretch of a file the delta encoder is working on. The encoder only
+ * looks at bytes between the start of its pending literal and one block
+ * past the offset it is matching, so that much is kept and the rest of
+ * the file is read as the encoder moves forward.
+ */
+class DFSDeltaWindow {
+
+private:
+    const DFSReadFile &file;
+
+    std::vector<char> buffer;
+
+    /** File offset of the first buffered byte **/
+    size_t start;
+
+    /** Number of buffered bytes **/
+    size_t length;
+
+public:
+    DFSDeltaWindow(const DFSReadFile &file, size_t capacity) :
+        file(file), buffer(std::min(capacity, file.Size())), start(0), length(0) {}
+
+    /**
+     * The bytes [offset, offset + size) of the file
+     *
+     * @param keep the lowest offset that must stay buffered if the window moves
+     * @param offset
+     * @param size
+     * @return const char* NULL if the file could not be read
+     */
+    const char *At(size_t keep, size_t offset, size_t size) {
+        if (offset >= this->start && offset + size <= this->start + this->length) {
+            return this->buffer.data() + (offset - this->start);
+        }
+
+        size_t new_start = std::min(keep, offset);
+        if (this->buffer.size() < offset + size - new_start) {
+            this->buffer.resize(offset + size - new_start);
+        }
+
+        // Bytes still buffered past the new start are moved, not read again
+        size_t kept = 0;
+        if (new_start >= this->start && new_start < this->start + this->length) {
+            kept = this->start + this->length - new_start;
+            std::memmove(this->buffer.data(), this->buffer.data() + (new_start - this->start), kept);
+        }
+        this->start = new_start;
+        this->length = std::min(this->buffer.size(), this->file.Size() - new_start);
+        if (!this->file.Read(new_start + kept, this->length - kept, this->buffer.data() + kept)) {
+            this->length = 0;
+            return NULL;
+        }
+        return this->buffer.data() + (offset - this->start);
+    }
+};
+
+bool dfs_encode_delta(const DFSReadFile &file, const SignatureList &signatures,
+                      size_t literal_limit, const std::function<bool(const DeltaRequest&)> &send) {
+    size_t size = file.Size();
+    size_t block_size = signatures.block_size();
+    std::int64_t block_count = signatures.blocks_size();
+
+    // Only full blocks can match mid-file, a short last block only at the end
+    size_t tail_length = 0;
+    if (block_count > 0 && block_size > 0) {
+        tail_length = signatures.file_size() - (block_count - 1) * block_size;
+    }
+    std::int64_t full_blocks = tail_length == block_size ? block_count : block_count - 1;
+
+    std::unordered_map<std::uint32_t, std::vector<std::int64_t>> weak_index;
+    for (std::int64_t i = 0; i < full_blocks; i++) {
+        weak_index[signatures.blocks(i).weak()].push_back(i);
+    }
+
+    size_t literal_start = 0;
+    DeltaRequest copy;
+    BlockRun *run = copy.mutable_copy();
+    run->set_count(0);
+
+    // Room for a full literal and the block after it, with slack so the
+    // window moves only every few megabytes
+    DFSDeltaWindow window(file, 4 * (literal_limit + block_size));
+    auto bytes = [&](size_t offset, size_t length) {
+        return window.At(literal_start, offset, length);
+    };
+
+    auto flush_copy = [&]() {
+        if (run->count() == 0) {
+            return true;
+        }
+        bool sent = send(copy);
+        run->set_count(0);
+        return sent;
+    };
+
+    auto flush_literal = [&](size_t end) {
+        DeltaRequest literal;
+        while (literal_start < end) {
+            size_t length = std::min(literal_limit, end - literal_start);
+            const char *data = bytes(literal_start, length);
+            if (data == NULL) {
+                return false;
+            }
+            literal.set_literal(data, length);
+            if (!send(literal)) {
+                return false;
+            }
+            literal_start += length;
+        }
+        return true;
+    };
+
+    // A block matched at `offset`: send the literal bytes before it, then
+    // extend the pending run or start a new one
+    auto add_block = [&](size_t offset, std::int64_t block) {
+        if (literal_start < offset && !(flush_copy() && flush_literal(offset))) {
+            return false;
+        }
+        if (run->count() > 0 && run->first() + run->count() == block) {
+            run->set_count(run->count() + 1);
+            return true;
+        }
+        if (!flush_copy()) {
+            return false;
+        }
+        run->set_first(block);
+        run->set_count(1);
+        return true;
+    };
+
+    // Find the block matching the window at `offset`, preferring the one
+    // that continues the pending run
+    auto find_block = [&](const char *data, std::uint32_t weak) -> std::int64_t {
+        auto iter = weak_index.find(weak);
+        if (iter == weak_index.end()) {
+            return -1;
+        }
+        std::string strong = dfs_strong_checksum(data, block_size);
+        std::int64_t next = run->count() > 0 ? run->first() + run->count() : -1;
+        std::int64_t found = -1;
+        for (std::int64_t block : iter->second) {
+            if (signatures.blocks(block).strong() == strong) {
+                found = block;
+                if (block == next) {
+                    break;
+                }
+            }
+        }
+        return found;
+    };
+
+    size_t offset = 0;
+    DFSRollingChecksum weak;
+    if (full_blocks > 0 && size >= block_size) {
+        const char *data = bytes(0, block_size);
+        if (data == NULL) {
+            return false;
+        }
+        weak.Reset(data, block_size);
+    }
+
+    while (full_blocks > 0 && offset + block_size <= size) {
+        const char *data = bytes(offset, block_size);
+        if (data == NULL) {
+            return false;
+        }
+
+        std::int64_t block = find_block(data, weak.Value());
+        if (block >= 0) {
+            if (!add_block(offset, block)) {
+                return false;
+            }
+            offset += block_size;
+            literal_start = offset;
+            if (offset + block_size <= size) {
+                data = bytes(offset, block_size);
+                if (data == NULL) {
+                    return false;
+                }
+                weak.Reset(data, block_size);
+            }
+            continue;
+        }
+
+        // Keep unmatched stretches from piling up before they are sent
+        if (offset - literal_start >= literal_limit && !(flush_copy() && flush_literal(offset))) {
+            return false;
+        }
+        if (offset + block_size < size) {
+            // Sending the literal may have moved the window
+            data = bytes(offset, block_size + 1);
+            if (data == NULL) {
+                return false;
+            }
+            weak.Roll(data[0], data[block_size]);
+        }
+        offset++;
+    }
+
+    // The short last block can only match the very end of the file
+    if (tail_length > 0 && tail_length < block_size && size >= tail_length && literal_start <= size - tail_length) {
+        const dfs_service::BlockSignature &tail = signatures.blocks(block_count - 1);
+        size_t tail_offset = size - tail_length;
+        const char *data = bytes(tail_offset, tail_length);
+        if (data == NULL) {
+            return false;
+        }
+        weak.Reset(data, tail_length);
+        if (weak.Value() == tail.weak() && dfs_strong_checksum(data, tail_length) == tail.strong()) {
+            if (!add_block(tail_offset, block_count - 1)) {
+                return false;
+            }
+            literal_start = size;
+        }
+    }
+
+    if (literal_start < size && !(flush_copy() && flush_literal(size))) {
+        return false;
+    }
+    return flush_copy();
+}
@@ -0,0 +1,111 @@
+#ifndef PR4_DFSLIB_DELTA_H
+#define PR4_DFSLIB_DELTA_H
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+#include "dfslib-shared-p2.h"
+#include "proto-src/dfs-service.pb.h"
+
+//
+// rsync-style delta encoding.
+//
+// The server splits its copy of a file into fixed-size blocks and sends a
+// weak rolling checksum and a strong hash for each. The client rolls the
+// weak checksum over every offset of its own copy, confirms candidate
+// matches with the strong hash, and describes its file as runs of the
+// server's blocks plus the literal bytes in between.
+//
+
+/** Files smaller than this are always sent whole **/
+#define DFS_DELTA_MIN_SIZE (1024*1024)
+
+/** Smallest and largest block size used for signatures **/
+#define DFS_DELTA_MIN_BLOCK (2*1024)
+#define DFS_DELTA_MAX_BLOCK (128*1024)
+
+/**
+ * The rsync weak checksum, which can slide along a buffer one byte
+ * at a time.
+ */
+class DFSRollingChecksum {
+
+private:
+    /** Sum of the bytes in the window **/
+    std::uint32_t a;
+
+    /** Sum of the running values of `a` **/
+    std::uint32_t b;
+
+    /** Length of the window **/
+    size_t length;
+
+public:
+    DFSRollingChecksum();
+
+    /**
+     * Start over with the checksum of a window
+     *
+     * @param data
+     * @param length
+     */
+    void Reset(const char* data, size_t length);
+
+    /**
+     * Slide the window one byte forward
+     *
+     * @param out the byte leaving the window
+     * @param in the byte entering the window
+     */
+    void Roll(unsigned char out, unsigned char in);
+
+    std::uint32_t Value() const;
+};
+
+/**
+ * Block size for the signatures of a file, about the square root of its
+ * size so the signature list and the expected literal bytes stay small
+ *
+ * @param file_size
+ * @return size_t
+ */
+size_t dfs_delta_block_size(size_t file_size);
+
+/**
+ * Strong hash of a block
+ *
+ * @param data
+ * @param length
+ * @return std::string
+ */
+std::string dfs_strong_checksum(const char* data, size_t length);
+
+/**
+ * Compute the block signatures of a file, reading it a block at a time
+ *
+ * @param file
+ * @param signatures
+ * @return bool false if the file could not be read to the end
+ */
+bool dfs_block_signatures(const DFSReadFile& file, dfs_service::SignatureList* signatures);
+
+/**
+ * Encode a file against the signatures of the server's copy.
+ *
+ * Block references to consecutive blocks are merged into one run, and
+ * literal bytes are sent in messages of at most `literal_limit` bytes.
+ * Only the bytes between the pending literal and the block being matched
+ * are held in memory.
+ *
+ * @param file
+ * @param signatures
+ * @param literal_limit
+ * @param send called for every delta message, returns false to stop
+ * @return bool false if `send` failed or the file could not be read
+ */
+bool dfs_encode_delta(const DFSReadFile& file, const dfs_service::SignatureList& signatures,
+                      size_t literal_limit, const std::function<bool(const dfs_service::DeltaRequest&)>& send);
+
+#endif
@@ -0,0 +1,123 @@
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <utility>
+#include <sys/inotify.h>
+
+#include "dfslib-shared-p2.h"
+#include "dfslib-events-p2.h"
+
+DFSEventCoalescer::DFSEventCoalescer() : stopping(false), events(0), stores(0), deletes(0), cancelled(0) {}
+
+DFSEventCoalescer::~DFSEventCoalescer() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->event_cv.notify_all();
+    if (this->thread.joinable()) {
+        this->thread.join();
+    }
+}
+
+void DFSEventCoalescer::Start(const FlushCallback &flush) {
+    this->thread = std::thread(&DFSEventCoalescer::Run, this, flush);
+}
+
+DFSEventCoalescer::Clock::time_point DFSEventCoalescer::DueLocked(const Pending &entry) const {
+    if (entry.closed) {
+        return entry.last_event;
+    }
+    return std::min(entry.last_event + std::chrono::milliseconds(DFS_EVENT_QUIET_MS),
+                    entry.first_event + std::chrono::milliseconds(DFS_EVENT_MAX_DELAY_MS));
+}
+
+void DFSEventCoalescer::Add(const std::string &file_name, std::uint32_t mask) {
+    Clock::time_point now = Clock::now();
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->events++;
+
+        auto entry = this->pending.find(file_name);
+        if (entry == this->pending.end()) {
+            Pending fresh;
+            fresh.action = STORE;
+            fresh.created = false;
+            fresh.closed = false;
+            fresh.first_event = now;
+            entry = this->pending.emplace(file_name, fresh).first;
+        }
+        Pending &file = entry->second;
+        file.last_event = now;
+
+        if (mask & IN_DELETE) {
+            if (file.created) {
+                // The server never heard of it
+                this->pending.erase(entry);
+                this->cancelled++;
+                return;
+            }
+            file.action = DELETE;
+            file.closed = false;
+        }
+        else {
+            // A file deleted and written again in one burst is stored, not recreated
+            file.created = file.created || ((mask & IN_CREATE) != 0 && file.action == STORE);
+            file.action = STORE;
+            file.closed = (mask & IN_CLOSE_WRITE) != 0;
+        }
+    }
+    this->event_cv.notify_one();
+}
+
+void DFSEventCoalescer::Run(const FlushCallback &flush) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (!this->stopping) {
+        Clock::time_point now = Clock::now();
+        Clock::time_point wake = Clock::time_point::max();
+        std::vector<std::pair<std::string, Action>> due;
+        for (auto entry = this->pending.begin(); entry != this->pending.end();) {
+            Clock::time_point due_at = DueLocked(entry->second);
+            if (due_at > now) {
+                wake = std::min(wake, due_at);
+                ++entry;
+                continue;
+            }
+            due.emplace_back(entry->first, entry->second.action);
+            if (entry->second.action == STORE) {
+                this->stores++;
+            }
+            else {
+                this->deletes++;
+            }
+            entry = this->pending.erase(entry);
+        }
+
+        if (due.empty()) {
+            size_t events_seen = this->events;
+            this->event_cv.wait_until(lock, wake,
+                                      [&] { return this->stopping || this->events != events_seen; });
+            continue;
+        }
+
+        // Events that come in meanwhile start a new pending operation
+        lock.unlock();
+        for (const auto &file : due) {
+            flush(file.first, file.second);
+        }
+        dfs_log(LL_DEBUG) << "Mount events: " << Stats();
+        lock.lock();
+    }
+}
+
+std::string DFSEventCoalescer::Stats() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    std::stringstream stats;
+    stats << this->events << " events became " << this->stores << " stores and " << this->deletes << " deletes, "
+          << this->cancelled << " files created and deleted before syncing, " << this->pending.size()
+          << " pending";
+    return stats.str();
+}
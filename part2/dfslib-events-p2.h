@@ -0,0 +1,112 @@
+#ifndef PR4_DFSLIB_EVENTS_H
+#define PR4_DFSLIB_EVENTS_H
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <condition_variable>
+
+/** How long a file has to go without events before it is synced **/
+#define DFS_EVENT_QUIET_MS 100
+
+/** Longest a file that keeps changing waits before it is synced anyway **/
+#define DFS_EVENT_MAX_DELAY_MS 5000
+
+/**
+ * Buffers the inotify events of the client mount until each file settles.
+ *
+ * A single large write arrives as dozens of IN_MODIFY events; storing on
+ * each of them checksums, locks and uploads the file over and over. The
+ * coalescer keeps one pending operation per file instead, and hands it
+ * over once the writer closes the file, or no event came for
+ * DFS_EVENT_QUIET_MS, or DFS_EVENT_MAX_DELAY_MS passed since the first
+ * event. Creates and modifies collapse into a store, a delete replaces
+ * them, and a file created and deleted before it was synced is never
+ * sent at all.
+ */
+class DFSEventCoalescer {
+
+public:
+    enum Action { STORE, DELETE };
+
+    /** Runs the settled operation of a file, on the coalescer's thread **/
+    typedef std::function<void(const std::string& file_name, Action action)> FlushCallback;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    /** What is waiting to be done for one file **/
+    struct Pending {
+        Action action;
+
+        /** Whether the file was created since its last sync, so a delete cancels it **/
+        bool created;
+
+        /** Whether the writer closed the file, so it can go right away **/
+        bool closed;
+
+        Clock::time_point first_event;
+        Clock::time_point last_event;
+    };
+
+    std::mutex mutex;
+    std::condition_variable event_cv;
+
+    std::map<std::string, Pending> pending;
+
+    bool stopping;
+
+    size_t events;
+    size_t stores;
+    size_t deletes;
+
+    /** Files created and deleted again before they were synced **/
+    size_t cancelled;
+
+    std::thread thread;
+
+    /**
+     * When a pending file is due; the mutex must be held
+     *
+     * @param entry
+     * @return Clock::time_point
+     */
+    Clock::time_point DueLocked(const Pending& entry) const;
+
+    void Run(const FlushCallback& flush);
+
+public:
+    DFSEventCoalescer();
+
+    ~DFSEventCoalescer();
+
+    /**
+     * Start handing settled files to `flush` in the background
+     *
+     * @param flush
+     */
+    void Start(const FlushCallback& flush);
+
+    /**
+     * Record an inotify event for a file of the mount
+     *
+     * @param file_name
+     * @param mask the inotify event mask
+     */
+    void Add(const std::string& file_name, std::uint32_t mask);
+
+    /**
+     * One-line summary of the events received and the operations they
+     * became, for logging
+     *
+     * @return std::string
+     */
+    std::string Stats();
+};
+
+#endif
@@ -0,0 +1,395 @@
+#include <map>
+#include <set>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <poll.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#include "dfslib-shared-p2.h"
+#include "dfslib-index-p2.h"
+
+/**
+ * Fill in the metadata of a file from its stat
+ *
+ * @param st
+ * @param meta
+ */
+static void dfs_meta_from_stat(const struct stat &st, DFSFileMeta *meta) {
+    meta->size = st.st_size;
+    meta->mtime_ns = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    meta->ctime = static_cast<long>(st.st_ctim.tv_sec);
+}
+
+DFSMetadataIndex::DFSMetadataIndex(const std::string &mount_path) :
+    mount_path(mount_path), updates(0), listings(0), delta_listings(0) {
+    std::shared_ptr<DFSDirSnapshot> first = std::make_shared<DFSDirSnapshot>();
+    first->version = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    this->journal_floor = first->version;
+    this->snapshot = std::move(first);
+}
+
+void DFSMetadataIndex::PublishLocked(std::shared_ptr<DFSDirSnapshot> next, const std::vector<std::string> *file_names) {
+    std::lock_guard<std::mutex> lock(this->journal_mutex);
+    if (file_names == NULL) {
+        this->journal.clear();
+        this->journal_floor = next->version;
+    }
+    else {
+        for (const std::string &file_name : *file_names) {
+            this->journal.emplace_back(next->version, file_name);
+        }
+        while (this->journal.size() > DFS_JOURNAL_CAPACITY) {
+            // Changes at the dropped version may now be incomplete
+            this->journal_floor = this->journal.front().first;
+            this->journal.pop_front();
+        }
+    }
+    std::atomic_store(&this->snapshot, std::shared_ptr<const DFSDirSnapshot>(std::move(next)));
+    this->updates++;
+}
+
+void DFSMetadataIndex::NotifyChange() {
+    if (this->on_change) {
+        this->on_change();
+    }
+}
+
+void DFSMetadataIndex::SetChangeCallback(const std::function<void()> &on_change) {
+    this->on_change = on_change;
+}
+
+std::uint64_t DFSMetadataIndex::Version() {
+    return std::atomic_load(&this->snapshot)->version;
+}
+
+bool DFSMetadataIndex::Rebuild() {
+    DIR *dir = opendir(this->mount_path.c_str());
+    if (dir == NULL) {
+        dfs_log(LL_ERROR) << "Metadata index failed to open " << this->mount_path;
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(this->write_mutex);
+    std::shared_ptr<DFSDirSnapshot> next = std::make_shared<DFSDirSnapshot>();
+    next->version = std::atomic_load(&this->snapshot)->version + 1;
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        std::string file_name(ent->d_name);
+        struct stat st;
+        if (file_name[0] == '.' || stat((this->mount_path + file_name).c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        DFSFileMeta &meta = next->files[file_name];
+        dfs_meta_from_stat(st, &meta);
+        meta.crc = 0;
+        meta.version = next->version;
+    }
+    closedir(dir);
+
+    PublishLocked(std::move(next), NULL);
+    lock.unlock();
+    NotifyChange();
+    return true;
+}
+
+bool DFSMetadataIndex::StageLocked(const DFSDirSnapshot &current, std::shared_ptr<DFSDirSnapshot> *next,
+                                   const std::string &file_name, std::uint32_t crc,
+                                   std::vector<std::string> *staged) {
+    if (file_name.empty() || file_name[0] == '.') {
+        return false;
+    }
+    const DFSDirSnapshot &base = *next ? **next : current;
+    auto file_iter = base.files.find(file_name);
+
+    // Stat under the lock, so racing updates of a file publish in the order they saw it
+    struct stat st;
+    bool exists = stat((this->mount_path + file_name).c_str(), &st) == 0 && S_ISREG(st.st_mode);
+    DFSFileMeta meta;
+    if (exists) {
+        dfs_meta_from_stat(st, &meta);
+        meta.crc = crc;
+    }
+
+    if (file_iter == base.files.end()) {
+        if (!exists) {
+            return false;
+        }
+    }
+    else if (exists) {
+        const DFSFileMeta &old = file_iter->second;
+        if (crc == 0 && old.size == meta.size && old.mtime_ns == meta.mtime_ns) {
+            meta.crc = old.crc;
+        }
+        if (old.size == meta.size && old.mtime_ns == meta.mtime_ns && old.ctime == meta.ctime &&
+                old.crc == meta.crc) {
+            return false;
+        }
+    }
+
+    // Copy the published snapshot once for all the changes of a batch
+    if (!*next) {
+        *next = std::make_shared<DFSDirSnapshot>(current);
+        (*next)->version++;
+    }
+    if (exists) {
+        meta.version = (*next)->version;
+        (*next)->files[file_name] = meta;
+    }
+    else {
+        (*next)->files.erase(file_name);
+    }
+    staged->push_back(file_name);
+    return true;
+}
+
+void DFSMetadataIndex::Update(const std::string &file_name, std::uint32_t crc) {
+    std::unique_lock<std::mutex> lock(this->write_mutex);
+    std::shared_ptr<DFSDirSnapshot> next;
+    std::vector<std::string> staged;
+    if (StageLocked(*std::atomic_load(&this->snapshot), &next, file_name, crc, &staged)) {
+        PublishLocked(std::move(next), &staged);
+        lock.unlock();
+        NotifyChange();
+    }
+}
+
+void DFSMetadataIndex::Update(const std::vector<std::string> &file_names) {
+    std::unique_lock<std::mutex> lock(this->write_mutex);
+    std::shared_ptr<const DFSDirSnapshot> current = std::atomic_load(&this->snapshot);
+    std::shared_ptr<DFSDirSnapshot> next;
+    std::vector<std::string> staged;
+    for (const std::string &file_name : file_names) {
+        StageLocked(*current, &next, file_name, 0, &staged);
+    }
+    if (next) {
+        PublishLocked(std::move(next), &staged);
+        lock.unlock();
+        NotifyChange();
+    }
+}
+
+void DFSMetadataIndex::Remove(const std::string &file_name) {
+    std::unique_lock<std::mutex> lock(this->write_mutex);
+    std::shared_ptr<const DFSDirSnapshot> current = std::atomic_load(&this->snapshot);
+    if (current->files.count(file_name) == 0) {
+        return;
+    }
+
+    std::shared_ptr<DFSDirSnapshot> next = std::make_shared<DFSDirSnapshot>(*current);
+    next->version++;
+    next->files.erase(file_name);
+    std::vector<std::string> staged(1, file_name);
+    PublishLocked(std::move(next), &staged);
+    lock.unlock();
+    NotifyChange();
+}
+
+std::shared_ptr<const DFSDirSnapshot> DFSMetadataIndex::Snapshot() {
+    this->listings++;
+    return std::atomic_load(&this->snapshot);
+}
+
+DFSDirChanges DFSMetadataIndex::Changes(std::uint64_t since_version) {
+    DFSDirChanges changes;
+    std::lock_guard<std::mutex> lock(this->journal_mutex);
+    changes.snapshot = std::atomic_load(&this->snapshot);
+    changes.full = since_version < this->journal_floor || since_version > changes.snapshot->version;
+    if (changes.full) {
+        this->listings++;
+        for (const auto &entry : changes.snapshot->files) {
+            changes.file_names.push_back(entry.first);
+        }
+        return changes;
+    }
+
+    // Versions only grow along the journal, so the changes are at its end
+    this->delta_listings++;
+    std::set<std::string> changed;
+    for (auto entry = this->journal.rbegin(); entry != this->journal.rend() && entry->first > since_version; ++entry) {
+        changed.insert(entry->second);
+    }
+    changes.file_names.assign(changed.begin(), changed.end());
+    return changes;
+}
+
+std::string DFSMetadataIndex::Stats() {
+    std::shared_ptr<const DFSDirSnapshot> current = std::atomic_load(&this->snapshot);
+    std::stringstream stats;
+    stats << current->files.size() << " files at version " << current->version << ", "
+          << this->updates << " updates, " << this->listings << " full and " << this->delta_listings
+          << " delta listings served";
+    return stats.str();
+}
+
+DFSWatchHub::DFSWatchHub(long heartbeat_ms) :
+    published(false), stopping(false), heartbeat(heartbeat_ms), fan_outs(0), sent(0), coalesced(0) {
+    this->thread = std::thread(&DFSWatchHub::Run, this);
+}
+
+DFSWatchHub::~DFSWatchHub() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->change_cv.notify_all();
+    this->thread.join();
+}
+
+void DFSWatchHub::Subscribe(DFSWatchSubscriber *subscriber) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->subscribers.insert(subscriber);
+}
+
+void DFSWatchHub::Unsubscribe(DFSWatchSubscriber *subscriber) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->subscribers.erase(subscriber);
+}
+
+void DFSWatchHub::Publish() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->published = true;
+    }
+    this->change_cv.notify_one();
+}
+
+void DFSWatchHub::Run() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (!this->stopping) {
+        // A quiet spell sends everyone a heartbeat instead
+        this->change_cv.wait_for(lock, this->heartbeat, [this] { return this->published || this->stopping; });
+        if (this->stopping) {
+            break;
+        }
+        this->published = false;
+        this->fan_outs++;
+
+        // Held throughout, so no subscriber is deleted while it is notified
+        for (DFSWatchSubscriber *subscriber : this->subscribers) {
+            if (subscriber->Notify()) {
+                this->sent++;
+            }
+            else {
+                this->coalesced++;
+            }
+        }
+    }
+}
+
+std::string DFSWatchHub::Stats() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    std::stringstream stats;
+    stats << this->subscribers.size() << " watchers, " << this->fan_outs << " fan-outs, " << this->sent
+          << " listings started and " << this->coalesced << " folded into pending ones";
+    return stats.str();
+}
+
+DFSMountWatcher::DFSMountWatcher(const std::string &mount_path) :
+    mount_path(mount_path), inotify_fd(-1), stop_fd(-1), events(0), batches(0), overflows(0) {}
+
+DFSMountWatcher::~DFSMountWatcher() {
+    if (this->thread.joinable()) {
+        std::uint64_t one = 1;
+        if (write(this->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+            dfs_log(LL_ERROR) << "Mount watcher failed to signal its thread: " << strerror(errno);
+        }
+        this->thread.join();
+    }
+    if (this->inotify_fd != -1) {
+        close(this->inotify_fd);
+    }
+    if (this->stop_fd != -1) {
+        close(this->stop_fd);
+    }
+}
+
+bool DFSMountWatcher::Start(const ChangeCallback &on_change) {
+    this->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    this->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (this->inotify_fd == -1 || this->stop_fd == -1) {
+        dfs_log(LL_ERROR) << "Mount watcher failed to start: " << strerror(errno);
+        return false;
+    }
+
+    // Whole writes and renames only: IN_MODIFY would fire for every write call
+    uint32_t mask = IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+    if (inotify_add_watch(this->inotify_fd, this->mount_path.c_str(), mask) == -1) {
+        dfs_log(LL_ERROR) << "Mount watcher failed to watch " << this->mount_path << ": " << strerror(errno);
+        return false;
+    }
+
+    this->thread = std::thread(&DFSMountWatcher::Run, this, on_change);
+    return true;
+}
+
+void DFSMountWatcher::Run(const ChangeCallback &on_change) {
+    std::vector<char> buffer(DFS_I_BUFFER_SIZE);
+    struct pollfd fds[2] = {{this->inotify_fd, POLLIN, 0}, {this->stop_fd, POLLIN, 0}};
+
+    while (true) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            dfs_log(LL_ERROR) << "Mount watcher failed to poll: " << strerror(errno);
+            return;
+        }
+        if (fds[1].revents != 0) {
+            return;
+        }
+
+        // Let the rest of a burst arrive, then drain everything pending
+        std::this_thread::sleep_for(std::chrono::milliseconds(DFS_WATCH_BATCH_MS));
+        std::set<std::string> changed;
+        bool overflow = false;
+        ssize_t len;
+        while ((len = read(this->inotify_fd, buffer.data(), buffer.size())) > 0) {
+            for (ssize_t index = 0; index < len;) {
+                const inotify_event *event = reinterpret_cast<const inotify_event *>(&buffer[index]);
+                index += DFS_I_EVENT_SIZE + event->len;
+                this->events++;
+
+                if (event->mask & IN_Q_OVERFLOW) {
+                    overflow = true;
+                }
+                else if (event->mask & IN_IGNORED) {
+                    dfs_log(LL_ERROR) << "Mount watcher lost its watch of " << this->mount_path;
+                }
+                else if (event->len > 0 && event->name[0] != '.') {
+                    changed.insert(event->name);
+                }
+            }
+        }
+        if (len == -1 && errno != EAGAIN && errno != EINTR) {
+            dfs_log(LL_ERROR) << "Mount watcher failed to read events: " << strerror(errno);
+            return;
+        }
+
+        if (changed.empty() && !overflow) {
+            continue;
+        }
+        this->batches++;
+        this->overflows += overflow ? 1 : 0;
+        on_change(std::vector<std::string>(changed.begin(), changed.end()), overflow);
+    }
+}
+
+std::string DFSMountWatcher::Stats() {
+    std::stringstream stats;
+    stats << this->events << " events in " << this->batches << " batches, " << this->overflows << " overflows";
+    return stats.str();
+}
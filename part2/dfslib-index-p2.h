@@ -0,0 +1,328 @@
+#ifndef PR4_DFSLIB_INDEX_H
+#define PR4_DFSLIB_INDEX_H
+
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+/** How long the mount watcher keeps collecting events after the first of a batch **/
+#define DFS_WATCH_BATCH_MS 10
+
+/** Changes the journal remembers; clients further behind get a full listing **/
+#define DFS_JOURNAL_CAPACITY 65536
+
+/** What the index knows of one file in the mount **/
+struct DFSFileMeta {
+    size_t size;
+    std::int64_t mtime_ns;
+    long ctime;
+
+    /** CRC of the contents, 0 until a store or fetch reports it **/
+    std::uint32_t crc;
+
+    /** Index version at which the file last changed **/
+    std::uint64_t version;
+};
+
+/** An immutable view of the whole mount **/
+struct DFSDirSnapshot {
+    /**
+     * Version of this view, one higher for every change. Counting starts
+     * at the server's start time in microseconds, so a version handed out
+     * by an earlier run is always older than anything this run knows.
+     */
+    std::uint64_t version;
+
+    std::map<std::string, DFSFileMeta> files;
+};
+
+/** What changed in the mount after a given version **/
+struct DFSDirChanges {
+    /** The view the changes are taken from **/
+    std::shared_ptr<const DFSDirSnapshot> snapshot;
+
+    /** Whether the journal did not reach back far enough, so every file is listed **/
+    bool full;
+
+    /** Files changed since the version; those missing from the snapshot were removed **/
+    std::vector<std::string> file_names;
+};
+
+/**
+ * Metadata of the files in the server mount, kept in memory.
+ *
+ * The index is read from disk once at startup and then kept up to date
+ * by the handlers that change the mount, so listings need no readdir or
+ * stat calls. Readers take the current snapshot without locking; each
+ * change copies the snapshot, edits the copy and publishes it, so a
+ * listing always sees one consistent version. Dot-prefixed files are
+ * internal and never indexed.
+ *
+ * Each change also goes into a journal of the names it touched, so a
+ * client that saw one version can be sent just what changed since.
+ */
+class DFSMetadataIndex {
+
+private:
+    /** The mount the indexed files live in **/
+    std::string mount_path;
+
+    /** Serializes changes; readers never take it **/
+    std::mutex write_mutex;
+
+    /** The current snapshot, read and replaced with the atomic shared_ptr functions **/
+    std::shared_ptr<const DFSDirSnapshot> snapshot;
+
+    /** Guards the journal, and makes it change together with the snapshot **/
+    std::mutex journal_mutex;
+
+    /** The versions at which files changed, oldest first **/
+    std::deque<std::pair<std::uint64_t, std::string>> journal;
+
+    /** Oldest version the journal can give the changes since **/
+    std::uint64_t journal_floor;
+
+    std::atomic<size_t> updates;
+    std::atomic<size_t> listings;
+    std::atomic<size_t> delta_listings;
+
+    /** Called after each published change, with no lock of the index held **/
+    std::function<void()> on_change;
+
+    /**
+     * Swap in a new snapshot and journal the files it changed; the write
+     * mutex must be held
+     *
+     * @param next
+     * @param file_names NULL if every file may have changed
+     */
+    void PublishLocked(std::shared_ptr<DFSDirSnapshot> next, const std::vector<std::string>* file_names);
+
+    void NotifyChange();
+
+    /**
+     * Stage the current metadata of a file in `next`, copying `current`
+     * into it on the first change; the write mutex must be held
+     *
+     * @return bool false if the file was unchanged
+     */
+    bool StageLocked(const DFSDirSnapshot& current, std::shared_ptr<DFSDirSnapshot>* next,
+                     const std::string& file_name, std::uint32_t crc, std::vector<std::string>* staged);
+
+public:
+    explicit DFSMetadataIndex(const std::string& mount_path);
+
+    /**
+     * Read the metadata of every file in the mount, replacing the index
+     *
+     * @return bool false if the mount could not be read
+     */
+    bool Rebuild();
+
+    /**
+     * Set what to call after every change, before the index is shared
+     *
+     * @param on_change
+     */
+    void SetChangeCallback(const std::function<void()>& on_change);
+
+    /**
+     * Version of the current snapshot
+     *
+     * @return std::uint64_t
+     */
+    std::uint64_t Version();
+
+    /**
+     * Record the current metadata of a file, or drop it if it is gone
+     *
+     * @param file_name
+     * @param crc checksum of the file if known, 0 keeps the one indexed
+     *            while the size and mtime are unchanged
+     */
+    void Update(const std::string& file_name, std::uint32_t crc = 0);
+
+    /**
+     * Record the current metadata of several files as one change
+     *
+     * @param file_names
+     */
+    void Update(const std::vector<std::string>& file_names);
+
+    /**
+     * Drop a deleted file
+     *
+     * @param file_name
+     */
+    void Remove(const std::string& file_name);
+
+    /**
+     * The current view of the mount, for a listing
+     *
+     * @return std::shared_ptr<const DFSDirSnapshot>
+     */
+    std::shared_ptr<const DFSDirSnapshot> Snapshot();
+
+    /**
+     * The files changed after a version a client saw
+     *
+     * @param since_version 0 for a full listing
+     * @return DFSDirChanges
+     */
+    DFSDirChanges Changes(std::uint64_t since_version);
+
+    /**
+     * One-line summary of the index, for logging
+     *
+     * @return std::string
+     */
+    std::string Stats();
+};
+
+/** A client stream told each time the metadata index changes **/
+class DFSWatchSubscriber {
+public:
+    virtual ~DFSWatchSubscriber() {}
+
+    /**
+     * The index moved on, or a heartbeat is due; must not block
+     *
+     * @return bool false if the change was folded into a listing
+     *              already waiting to be sent
+     */
+    virtual bool Notify() = 0;
+};
+
+/**
+ * Fans changes of the metadata index out to every watching client.
+ *
+ * Publishing only flags the change and wakes the hub's thread, so the
+ * handler that changed the index never waits on a slow client. The
+ * thread then notifies each subscriber, and again after each heartbeat
+ * interval that passes with no change. A subscriber keeps at most one listing in
+ * flight and one pending, and takes what changed from the index journal
+ * when it is sent, so repeated changes of a file while a client lags
+ * reach it once and its backlog never grows past the journal.
+ */
+class DFSWatchHub {
+
+private:
+    std::mutex mutex;
+    std::condition_variable change_cv;
+
+    std::set<DFSWatchSubscriber*> subscribers;
+
+    /** Whether the index changed since the last fan-out **/
+    bool published;
+
+    bool stopping;
+
+    std::chrono::milliseconds heartbeat;
+
+    size_t fan_outs;
+    size_t sent;
+    size_t coalesced;
+
+    std::thread thread;
+
+    void Run();
+
+public:
+    explicit DFSWatchHub(long heartbeat_ms);
+
+    ~DFSWatchHub();
+
+    /**
+     * Start notifying a subscriber; it must unsubscribe before it is deleted
+     *
+     * @param subscriber
+     */
+    void Subscribe(DFSWatchSubscriber* subscriber);
+
+    /**
+     * Stop notifying a subscriber, waiting out a fan-out in progress
+     *
+     * @param subscriber
+     */
+    void Unsubscribe(DFSWatchSubscriber* subscriber);
+
+    /** Tell every subscriber the index changed **/
+    void Publish();
+
+    /**
+     * One-line summary of the watchers and what they were sent, for logging
+     *
+     * @return std::string
+     */
+    std::string Stats();
+};
+
+/**
+ * Watches the server mount with inotify for changes made by other
+ * processes.
+ *
+ * A background thread drains every pending event once the mount
+ * changes, waits DFS_WATCH_BATCH_MS for the rest of a burst, and reports
+ * each changed name once per batch. Dot-prefixed files are internal and
+ * never reported. The server's own stores are reported too, which is
+ * harmless since updating the index with unchanged metadata is a no-op.
+ */
+class DFSMountWatcher {
+
+public:
+    /**
+     * Called with the names changed in a batch; `overflow` means events
+     * were lost and the whole mount has to be read again
+     */
+    typedef std::function<void(const std::vector<std::string>& file_names, bool overflow)> ChangeCallback;
+
+private:
+    std::string mount_path;
+
+    /** The inotify instance, -1 if not started **/
+    int inotify_fd;
+
+    /** Written to stop the thread **/
+    int stop_fd;
+
+    std::thread thread;
+
+    std::atomic<size_t> events;
+    std::atomic<size_t> batches;
+    std::atomic<size_t> overflows;
+
+    void Run(const ChangeCallback& on_change);
+
+public:
+    explicit DFSMountWatcher(const std::string& mount_path);
+
+    ~DFSMountWatcher();
+
+    /**
+     * Start watching in the background
+     *
+     * @param on_change
+     * @return bool false if inotify could not watch the mount
+     */
+    bool Start(const ChangeCallback& on_change);
+
+    /**
+     * One-line summary of the events seen, for logging
+     *
+     * @return std::string
+     */
+    std::string Stats();
+};
+
+#endif
@@ -0,0 +1,345 @@
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <functional>
+
+#include "dfslib-shared-p2.h"
+#include "dfslib-locks-p2.h"
+
+DFSSharedMutex::DFSSharedMutex() : readers(0), writers_waiting(0), writing(false) {}
+
+void DFSSharedMutex::lock() {
+    std::unique_lock<std::mutex> lock(this->state_mutex);
+    this->writers_waiting++;
+    this->writers_cv.wait(lock, [this] { return !this->writing && this->readers == 0; });
+    this->writers_waiting--;
+    this->writing = true;
+}
+
+bool DFSSharedMutex::try_lock() {
+    std::lock_guard<std::mutex> lock(this->state_mutex);
+    if (this->writing || this->readers > 0) {
+        return false;
+    }
+    this->writing = true;
+    return true;
+}
+
+void DFSSharedMutex::unlock() {
+    {
+        std::lock_guard<std::mutex> lock(this->state_mutex);
+        this->writing = false;
+    }
+    // Hand over to the next writer first, readers get in once none waits
+    this->writers_cv.notify_one();
+    this->readers_cv.notify_all();
+}
+
+void DFSSharedMutex::lock_shared() {
+    std::unique_lock<std::mutex> lock(this->state_mutex);
+    this->readers_cv.wait(lock, [this] { return !this->writing && this->writers_waiting == 0; });
+    this->readers++;
+}
+
+bool DFSSharedMutex::try_lock_shared() {
+    std::lock_guard<std::mutex> lock(this->state_mutex);
+    if (this->writing || this->writers_waiting > 0) {
+        return false;
+    }
+    this->readers++;
+    return true;
+}
+
+void DFSSharedMutex::unlock_shared() {
+    bool last;
+    {
+        std::lock_guard<std::mutex> lock(this->state_mutex);
+        last = --this->readers == 0;
+    }
+    if (last) {
+        this->writers_cv.notify_one();
+    }
+}
+
+DFSLockTable::DFSLockTable(long lease_ms) :
+        lease_duration(lease_ms), epoch(Clock::now()), next_tick(0), next_lease(0), stopping(false),
+        granted(0), renewed(0), released(0), expired(0), rejected(0),
+        wait_total(0), wait_max(0), reap_lag_total(0), queued(0), timed_out(0),
+        queue_wait_total(0), queue_wait_max(0) {
+    this->reaper = std::thread(&DFSLockTable::RunReaper, this);
+}
+
+DFSLockTable::~DFSLockTable() {
+    {
+        std::lock_guard<std::mutex> lock(this->wheel_mutex);
+        this->stopping = true;
+    }
+    this->stop_cv.notify_all();
+    this->reaper.join();
+}
+
+long DFSLockTable::LeaseMs() const {
+    return this->lease_duration.count();
+}
+
+DFSLockTable::Shard &DFSLockTable::ShardOf(const std::string &file_name) {
+    return this->shards[std::hash<std::string>()(file_name) % this->shards.size()];
+}
+
+DFSLockTable::FileLock &DFSLockTable::LockOf(Shard &shard, const std::string &file_name) {
+    std::unique_ptr<FileLock> &file_lock = shard.files[file_name];
+    if (!file_lock) {
+        file_lock = std::make_unique<FileLock>();
+    }
+    return *file_lock;
+}
+
+DFSSharedMutex &DFSLockTable::FileMutex(const std::string &file_name) {
+    Shard &shard = ShardOf(file_name);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return LockOf(shard, file_name).mutex;
+}
+
+void DFSLockTable::LeaseLocked(const std::string &file_name, FileLock &file_lock, Clock::time_point now) {
+    file_lock.expires = now + this->lease_duration;
+
+    // The lease is checked on the first tick at or after it runs out
+    std::chrono::milliseconds tick_length(DFS_LEASE_TICK_MS);
+    std::uint64_t tick = (std::chrono::duration_cast<std::chrono::milliseconds>(file_lock.expires - this->epoch) +
+                          tick_length - std::chrono::milliseconds(1)) / tick_length;
+
+    std::lock_guard<std::mutex> lock(this->wheel_mutex);
+    file_lock.lease = ++this->next_lease;
+    tick = std::max(tick, this->next_tick);
+    this->wheel[tick % this->wheel.size()].push_back({file_name, file_lock.lease, tick});
+}
+
+void DFSLockTable::HandOverLocked(const std::string &file_name, FileLock &file_lock, Clock::time_point now) {
+    if (file_lock.waiters.empty()) {
+        file_lock.owner.clear();
+        return;
+    }
+    Waiter *next = file_lock.waiters.front();
+    file_lock.waiters.pop_front();
+    file_lock.owner = next->client_id;
+    LeaseLocked(file_name, file_lock, now);
+    next->granted = true;
+    next->granted_cv.notify_one();
+}
+
+void DFSLockTable::Reap(Clock::time_point now) {
+    std::uint64_t now_tick = std::chrono::duration_cast<std::chrono::milliseconds>(now - this->epoch).count() /
+                             DFS_LEASE_TICK_MS;
+    std::vector<Expiry> due;
+    {
+        std::lock_guard<std::mutex> lock(this->wheel_mutex);
+        for (; this->next_tick <= now_tick; this->next_tick++) {
+            // A slot holds every lease due on a tick that maps to it, later turns stay
+            std::vector<Expiry> &slot = this->wheel[this->next_tick % this->wheel.size()];
+            auto later = std::partition(slot.begin(), slot.end(),
+                                        [this](const Expiry &expiry) { return expiry.tick <= this->next_tick; });
+            std::move(slot.begin(), later, std::back_inserter(due));
+            slot.erase(slot.begin(), later);
+        }
+    }
+
+    for (const Expiry &expiry : due) {
+        Shard &shard = ShardOf(expiry.file_name);
+        std::chrono::milliseconds lag;
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto file_iter = shard.files.find(expiry.file_name);
+            if (file_iter == shard.files.end()) {
+                continue;
+            }
+            FileLock &file_lock = *file_iter->second;
+            // Renewed or released since the expiry was filed
+            if (file_lock.lease != expiry.lease || file_lock.owner.empty() || file_lock.expires > now) {
+                continue;
+            }
+            dfs_log(LL_SYSINFO) << "Write lock of " << expiry.file_name << " held by " << file_lock.owner
+                                << " expired";
+            lag = std::chrono::duration_cast<std::chrono::milliseconds>(now - file_lock.expires);
+            HandOverLocked(expiry.file_name, file_lock, now);
+        }
+        std::lock_guard<std::mutex> lock(this->stats_mutex);
+        this->expired++;
+        this->reap_lag_total += lag;
+    }
+}
+
+void DFSLockTable::RunReaper() {
+    std::unique_lock<std::mutex> lock(this->wheel_mutex);
+    while (!this->stopping) {
+        this->stop_cv.wait_for(lock, std::chrono::milliseconds(DFS_LEASE_TICK_MS));
+        lock.unlock();
+        Reap(Clock::now());
+        lock.lock();
+    }
+}
+
+bool DFSLockTable::AcquireWrite(const std::string &file_name, const std::string &client_id,
+                                std::chrono::milliseconds wait) {
+    Shard &shard = ShardOf(file_name);
+    Clock::time_point now = Clock::now();
+    std::chrono::milliseconds left(0);
+    bool took_over = false;
+    {
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        FileLock &file_lock = LockOf(shard, file_name);
+        if (!file_lock.owner.empty() && file_lock.expires <= now) {
+            // A lease that ran out before the reaper got to it goes to the next in line
+            took_over = true;
+            HandOverLocked(file_name, file_lock, now);
+        }
+
+        if (file_lock.owner.empty()) {
+            file_lock.owner = client_id;
+            LeaseLocked(file_name, file_lock, now);
+        }
+        else if (wait.count() > 0) {
+            Waiter waiter;
+            waiter.client_id = client_id;
+            waiter.granted = false;
+            file_lock.waiters.push_back(&waiter);
+            bool granted = waiter.granted_cv.wait_until(lock, now + wait, [&waiter] { return waiter.granted; });
+            if (!granted) {
+                file_lock.waiters.erase(std::find(file_lock.waiters.begin(), file_lock.waiters.end(), &waiter));
+            }
+            lock.unlock();
+
+            std::chrono::milliseconds waited = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    Clock::now() - now);
+            std::lock_guard<std::mutex> stats_lock(this->stats_mutex);
+            this->expired += took_over ? 1 : 0;
+            if (!granted) {
+                this->timed_out++;
+                return false;
+            }
+            this->granted++;
+            this->queued++;
+            this->queue_wait_total += waited;
+            this->queue_wait_max = std::max(this->queue_wait_max, waited);
+            return true;
+        }
+        else {
+            left = std::chrono::duration_cast<std::chrono::milliseconds>(file_lock.expires - now);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(this->stats_mutex);
+    this->expired += took_over ? 1 : 0;
+    if (left.count() > 0) {
+        this->rejected++;
+        this->wait_total += left;
+        this->wait_max = std::max(this->wait_max, left);
+        return false;
+    }
+    this->granted++;
+    return true;
+}
+
+bool DFSLockTable::RenewWrite(const std::string &file_name, const std::string &client_id) {
+    Shard &shard = ShardOf(file_name);
+    Clock::time_point now = Clock::now();
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto file_iter = shard.files.find(file_name);
+        if (file_iter == shard.files.end() || client_id.empty() || file_iter->second->owner != client_id ||
+                file_iter->second->expires <= now) {
+            return false;
+        }
+        LeaseLocked(file_name, *file_iter->second, now);
+    }
+
+    std::lock_guard<std::mutex> lock(this->stats_mutex);
+    this->renewed++;
+    return true;
+}
+
+bool DFSLockTable::HoldsWrite(const std::string &file_name, const std::string &client_id) {
+    Shard &shard = ShardOf(file_name);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto file_iter = shard.files.find(file_name);
+    return file_iter != shard.files.end() && !client_id.empty() && file_iter->second->owner == client_id &&
+           file_iter->second->expires > Clock::now();
+}
+
+bool DFSLockTable::CommitIfHolder(const std::string &file_name, const std::string &client_id,
+                                  const std::function<void()> &commit) {
+    Shard &shard = ShardOf(file_name);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto file_iter = shard.files.find(file_name);
+    if (file_iter == shard.files.end() || client_id.empty() || file_iter->second->owner != client_id ||
+            file_iter->second->expires <= Clock::now()) {
+        return false;
+    }
+    commit();
+    return true;
+}
+
+void DFSLockTable::ReleaseWrite(const std::string &file_name, const std::string &client_id) {
+    Shard &shard = ShardOf(file_name);
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto file_iter = shard.files.find(file_name);
+        if (file_iter == shard.files.end() || client_id.empty() || file_iter->second->owner != client_id) {
+            return;
+        }
+        HandOverLocked(file_name, *file_iter->second, Clock::now());
+    }
+
+    std::lock_guard<std::mutex> lock(this->stats_mutex);
+    this->released++;
+}
+
+std::string DFSLockTable::Stats() {
+    std::lock_guard<std::mutex> lock(this->stats_mutex);
+    std::stringstream stats;
+    stats << this->granted << " leases granted, " << this->renewed << " renewed, " << this->released
+          << " released, " << this->expired << " expired";
+    if (this->expired > 0) {
+        stats << " (reaped " << this->reap_lag_total.count() / this->expired << " ms late on average)";
+    }
+    stats << ", " << this->rejected << " requests turned away";
+    if (this->rejected > 0) {
+        stats << " with " << this->wait_total.count() / this->rejected << " ms of lease left on average (max "
+              << this->wait_max.count() << " ms)";
+    }
+    stats << ", " << this->queued << " granted after queueing";
+    if (this->queued > 0) {
+        stats << " for " << this->queue_wait_total.count() / this->queued << " ms on average (max "
+              << this->queue_wait_max.count() << " ms)";
+    }
+    stats << ", " << this->timed_out << " gave up waiting";
+    return stats.str();
+}
+
+DFSLeaseKeeper::DFSLeaseKeeper(std::chrono::milliseconds interval, const std::function<void()> &renew) :
+        done(false) {
+    if (interval.count() <= 0) {
+        return;
+    }
+    this->thread = std::thread([this, interval, renew] {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (!this->done_cv.wait_for(lock, interval, [this] { return this->done; })) {
+            lock.unlock();
+            renew();
+            lock.lock();
+        }
+    });
+}
+
+DFSLeaseKeeper::~DFSLeaseKeeper() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->done = true;
+    }
+    this->done_cv.notify_all();
+    if (this->thread.joinable()) {
+        this->thread.join();
+    }
+}
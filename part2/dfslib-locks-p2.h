@@ -0,0 +1,307 @@
+#ifndef PR4_DFSLIB_LOCKS_H
+#define PR4_DFSLIB_LOCKS_H
+
+#include <array>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <deque>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+#include <unordered_map>
+
+/** Number of independently locked shards of the lock table **/
+#define DFS_LOCK_SHARDS 64
+
+/** How long a write lock is held unless its owner renews it (10 s) **/
+#define DFS_LEASE_MS 10000
+
+/** Resolution of the lease timer wheel **/
+#define DFS_LEASE_TICK_MS 100
+
+/** Slots of the lease timer wheel; leases further out stay for more turns **/
+#define DFS_LEASE_WHEEL_SLOTS 256
+
+/** Largest file a one-step store locks by itself; larger ones lock first so the lease is renewed throughout **/
+#define DFS_ONE_STEP_MAX_SIZE (1 << 20)
+
+/**
+ * A reader-writer lock that prefers writers.
+ *
+ * Readers share the lock; once a writer is waiting, new readers queue
+ * behind it, so a steady stream of fetches can't starve a store. Meets
+ * the SharedMutex requirements, so std::shared_lock and std::lock_guard
+ * work with it.
+ */
+class DFSSharedMutex {
+
+private:
+    std::mutex state_mutex;
+    std::condition_variable readers_cv;
+    std::condition_variable writers_cv;
+
+    /** Readers holding the lock **/
+    size_t readers;
+
+    /** Writers waiting for the lock **/
+    size_t writers_waiting;
+
+    /** Whether a writer holds the lock **/
+    bool writing;
+
+public:
+    DFSSharedMutex();
+
+    DFSSharedMutex(const DFSSharedMutex&) = delete;
+    DFSSharedMutex& operator=(const DFSSharedMutex&) = delete;
+
+    void lock();
+    bool try_lock();
+    void unlock();
+
+    void lock_shared();
+    bool try_lock_shared();
+    void unlock_shared();
+};
+
+/**
+ * The per-file locks of the server.
+ *
+ * File names hash to one of DFS_LOCK_SHARDS shards, each with its own
+ * map and mutex, so requests for different files rarely wait on each
+ * other just to look up their locks. Entries are never removed, which
+ * keeps the references handed out valid for the life of the table.
+ *
+ * Write locks are leases: a client that crashes, or whose store never
+ * arrives, loses its lock once the lease runs out. Expiries are kept in
+ * a timer wheel that a background thread advances one tick at a time, so
+ * reaping only looks at the leases due in that tick. Renewing a lease
+ * files a new expiry and leaves the old one to be dropped when its slot
+ * comes up.
+ *
+ * A writer may also wait for a busy lock. Waiters queue per file and the
+ * lock is handed to the first of them when it is released or expires,
+ * so they are served in the order they arrived and never have to poll.
+ */
+class DFSLockTable {
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    /** A writer queued for a busy lock **/
+    struct Waiter {
+        std::string client_id;
+
+        /** Set once the lock was handed to this writer **/
+        bool granted;
+
+        std::condition_variable granted_cv;
+    };
+
+    struct FileLock {
+        /** Shared while the file is read, exclusive while it is replaced or removed **/
+        DFSSharedMutex mutex;
+
+        /** Client holding the write lock, empty if none **/
+        std::string owner;
+
+        /** When the write lock runs out **/
+        Clock::time_point expires;
+
+        /** Number of the current lease, expiries filed for older ones are stale **/
+        std::uint64_t lease;
+
+        /** Writers waiting for the lock, first come first served **/
+        std::deque<Waiter*> waiters;
+    };
+
+    /** A lease filed in the wheel to be checked once its tick comes **/
+    struct Expiry {
+        std::string file_name;
+        std::uint64_t lease;
+        std::uint64_t tick;
+    };
+
+    struct Shard {
+        /** Guards the map and the owners of its files **/
+        std::mutex mutex;
+
+        std::unordered_map<std::string, std::unique_ptr<FileLock>> files;
+    };
+
+    std::array<Shard, DFS_LOCK_SHARDS> shards;
+
+    /** How long a lease lasts **/
+    std::chrono::milliseconds lease_duration;
+
+    /** Tick 0 of the wheel **/
+    Clock::time_point epoch;
+
+    /** Guards the wheel and the reaper state **/
+    std::mutex wheel_mutex;
+
+    std::array<std::vector<Expiry>, DFS_LEASE_WHEEL_SLOTS> wheel;
+
+    /** Next tick the reaper processes **/
+    std::uint64_t next_tick;
+
+    std::uint64_t next_lease;
+
+    bool stopping;
+    std::condition_variable stop_cv;
+    std::thread reaper;
+
+    /** Guards the counters below **/
+    std::mutex stats_mutex;
+
+    size_t granted;
+    size_t renewed;
+    size_t released;
+    size_t expired;
+    size_t rejected;
+
+    /** Lease time the holders still had when requests were turned away **/
+    std::chrono::milliseconds wait_total;
+    std::chrono::milliseconds wait_max;
+
+    /** Time expired leases kept their file locked before they were reaped **/
+    std::chrono::milliseconds reap_lag_total;
+
+    /** Writers that got the lock after queueing, and those that gave up **/
+    size_t queued;
+    size_t timed_out;
+
+    /** Time queued writers waited for the lock **/
+    std::chrono::milliseconds queue_wait_total;
+    std::chrono::milliseconds queue_wait_max;
+
+    Shard& ShardOf(const std::string& file_name);
+
+    /** The lock of a file, created on first use; the shard must be held **/
+    FileLock& LockOf(Shard& shard, const std::string& file_name);
+
+    /** Start a new lease on a lock for its owner; the shard must be held **/
+    void LeaseLocked(const std::string& file_name, FileLock& file_lock, Clock::time_point now);
+
+    /** Give a lock that was let go to the first waiter, if any; the shard must be held **/
+    void HandOverLocked(const std::string& file_name, FileLock& file_lock, Clock::time_point now);
+
+    /** Release the leases that ran out in the ticks up to `now` **/
+    void Reap(Clock::time_point now);
+
+    void RunReaper();
+
+public:
+    /**
+     * @param lease_ms how long a write lock lasts unless renewed
+     */
+    explicit DFSLockTable(long lease_ms = DFS_LEASE_MS);
+
+    ~DFSLockTable();
+
+    /**
+     * How long a write lock lasts unless renewed, in milliseconds
+     *
+     * @return long
+     */
+    long LeaseMs() const;
+    /**
+     * The reader-writer lock guarding a file's contents
+     *
+     * @param file_name
+     * @return DFSSharedMutex&
+     */
+    DFSSharedMutex& FileMutex(const std::string& file_name);
+
+    /**
+     * Take the write lock of a file for a client, for one lease.
+     *
+     * A busy lock fails at once unless `wait` is given, in which case the
+     * client queues behind earlier waiters until the lock is handed to it
+     * or the wait runs out.
+     *
+     * @param file_name
+     * @param client_id
+     * @param wait
+     * @return bool false if another client kept the lock
+     */
+    bool AcquireWrite(const std::string& file_name, const std::string& client_id,
+                      std::chrono::milliseconds wait = std::chrono::milliseconds(0));
+
+    /**
+     * Extend the lease of a write lock a client holds
+     *
+     * @param file_name
+     * @param client_id
+     * @return bool false if the client's lease is gone
+     */
+    bool RenewWrite(const std::string& file_name, const std::string& client_id);
+
+    /**
+     * Indicates if a client holds an unexpired write lock of a file
+     *
+     * @param file_name
+     * @param client_id
+     * @return bool
+     */
+    bool HoldsWrite(const std::string& file_name, const std::string& client_id);
+
+    /**
+     * Run `commit` only while a client holds an unexpired write lock of a
+     * file, with the lease kept from expiring or changing hands until it
+     * returns. Meant for the rename that publishes a store, so it must be
+     * short, and must not call back into the table.
+     *
+     * @param file_name
+     * @param client_id
+     * @param commit
+     * @return bool false if the client no longer held the lock and `commit` did not run
+     */
+    bool CommitIfHolder(const std::string& file_name, const std::string& client_id,
+                        const std::function<void()>& commit);
+
+    /**
+     * Release the write lock of a file if the client holds it, so a store
+     * that outlived its lease can't release the lock of the next owner
+     *
+     * @param file_name
+     * @param client_id
+     */
+    void ReleaseWrite(const std::string& file_name, const std::string& client_id);
+
+    /**
+     * One-line summary of the leases granted, renewed and expired and of
+     * how long turned away writers had to wait, for logging
+     *
+     * @return std::string
+     */
+    std::string Stats();
+};
+
+/**
+ * Renews a write lock in the background for as long as it is in scope,
+ * so a store that takes longer than a lease keeps its lock.
+ */
+class DFSLeaseKeeper {
+
+private:
+    std::mutex mutex;
+    std::condition_variable done_cv;
+    bool done;
+    std::thread thread;
+
+public:
+    /**
+     * @param interval time between renewals, 0 to never renew
+     * @param renew
+     */
+    DFSLeaseKeeper(std::chrono::milliseconds interval, const std::function<void()>& renew);
+
+    ~DFSLeaseKeeper();
+};
+
+#endif
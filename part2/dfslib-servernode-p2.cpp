@@ -1,5 +1,6 @@
 #include <map>
 #include <mutex>
+#include <condition_variable>
 #include <shared_mutex>
 #include <chrono>
 #include <cstdio>
@@ -12,12 +13,19 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <grpcpp/grpcpp.h>
 
 #include "proto-src/dfs-service.grpc.pb.h"
 #include "src/dfslibx-call-data.h"
 #include "src/dfslibx-service-runner.h"
 #include "dfslib-shared-p2.h"
+#include "dfslib-bulk-p2.h"
+#include "dfslib-delta-p2.h"
+#include "dfslib-chunks-p2.h"
+#include "dfslib-locks-p2.h"
+#include "dfslib-index-p2.h"
 #include "dfslib-servernode-p2.h"
 
 using grpc::Status;
@@ -25,14 +33,24 @@ using grpc::Server;
 using grpc::StatusCode;
 using grpc::ServerReader;
 using grpc::ServerWriter;
+using grpc::ServerReaderWriter;
 using grpc::ServerContext;
 using grpc::ServerBuilder;
 
 using dfs_service::DFSService;
+using dfs_service::BlockRun;
+using dfs_service::ChunkList;
+using dfs_service::ChunkRef;
+using dfs_service::ChunkPiece;
+using dfs_service::ChunkRequest;
+using dfs_service::DeltaRequest;
+using dfs_service::DeltaResponse;
 using dfs_service::FileData;
 using dfs_service::FileInfo;
 using dfs_service::FileList;
 using dfs_service::RequestFile;
+using dfs_service::SignatureList;
+using dfs_service::StoreRequest;
 using dfs_service::ReturnFileInfo;
 using dfs_service::ReturnMsg;
 using dfs_service::Void;
@@ -49,6 +67,270 @@ using FileListResponseType = FileList;
 
 extern dfs_log_level_e DFS_LOG_LEVEL;
 
+/**
+ * Streams a file to the client for FetchFile.
+ *
+ * Each chunk is read into a slice gRPC takes over, and a FileData
+ * message is serialized by hand around it, so file bytes are not copied
+ * again into a std::string. The CRC of the sent
+ * range is taken over the same slices and reported in the trailing
+ * metadata, so the client can verify what it received without either
+ * side reading the file again. The reactor deletes itself once gRPC is
+ * done with the call.
+ */
+class DFSFetchReactor : public grpc::ServerWriteReactor<grpc::ByteBuffer> {
+
+private:
+    /** The call, for the trailing metadata **/
+    grpc::CallbackServerContext *context;
+
+    /** The file being sent **/
+    std::shared_ptr<DFSReadFile> file;
+
+    /** The file name, for logging **/
+    std::string file_name;
+
+    /** Picks the size of each chunk **/
+    DFSChunkSizer chunk_sizer;
+
+    /** The chunk currently being written **/
+    grpc::ByteBuffer chunk;
+
+    /** Offset the requested range starts at **/
+    size_t start;
+
+    /** Offset of the current chunk in the file **/
+    size_t offset;
+
+    /** Offset the requested range ends at **/
+    size_t end;
+
+    /** Length of the current chunk **/
+    size_t chunk_length;
+
+    /** CRC of the bytes [start, offset + chunk_length) **/
+    std::uint32_t crc;
+
+    std::chrono::steady_clock::time_point start_time;
+    std::chrono::steady_clock::time_point write_start;
+
+    void NextWrite() {
+        if (this->offset >= this->end) {
+            dfs_log(LL_SYSINFO) << "Server sent " << this->offset - this->start << " bytes of " << this->file_name << " at "
+                                << dfs_megabytes_per_second(this->offset - this->start, std::chrono::steady_clock::now() - this->start_time)
+                                << " MB/s, final chunk size " << this->chunk_sizer.ChunkSize();
+            this->context->AddTrailingMetadata(DFS_RANGE_CRC_KEY, std::to_string(this->crc));
+            Finish(Status::OK);
+            return;
+        }
+
+        // Bytes already sent can't be taken back, so a file changed by an
+        // outside writer aborts the fetch and the client syncs again later
+        if (this->file->Changed()) {
+            dfs_log(LL_ERROR) << "File changed during transfer: " << this->file_name;
+            Finish(Status(StatusCode::ABORTED, "File changed during transfer"));
+            return;
+        }
+
+        this->chunk_length = std::min(this->chunk_sizer.ChunkSize(), this->end - this->offset);
+        grpc::Slice payload;
+        if (!dfs_read_slice(*this->file, this->offset, this->chunk_length, &payload)) {
+            dfs_log(LL_ERROR) << "File shrank during transfer: " << this->file_name;
+            Finish(Status(StatusCode::ABORTED, "File changed during transfer"));
+            return;
+        }
+        this->chunk = dfs_file_data_chunk(payload);
+        this->crc = dfs_crc32c(reinterpret_cast<const char *>(payload.begin()), payload.size(), this->crc);
+        this->write_start = std::chrono::steady_clock::now();
+        StartWrite(&this->chunk);
+    }
+
+public:
+    /**
+     * Finish the call straight away with an error status
+     *
+     * @param status
+     */
+    explicit DFSFetchReactor(const Status &status) :
+        context(NULL), chunk_sizer(DFS_MIN_CHUNK_SIZE), start(0), offset(0), end(0), chunk_length(0), crc(0) {
+        Finish(status);
+    }
+
+    /**
+     * Send the bytes [start, end) of a file
+     *
+     * @param context
+     * @param file
+     * @param file_name
+     * @param chunk_limit
+     * @param start
+     * @param end
+     */
+    DFSFetchReactor(grpc::CallbackServerContext *context, std::shared_ptr<DFSReadFile> file,
+                    const std::string &file_name, size_t chunk_limit, size_t start, size_t end) :
+        context(context), file(file), file_name(file_name), chunk_sizer(chunk_limit), start(start), offset(start),
+        end(end), chunk_length(0), crc(0), start_time(std::chrono::steady_clock::now()) {
+        dfs_log(LL_SYSINFO) << "Server starts sending data for file: " << file_name;
+        NextWrite();
+    }
+
+    void OnWriteDone(bool ok) override {
+        if (!ok) {
+            dfs_log(LL_ERROR) << "Deadline exceeded or Client cancelled, abandoning";
+            Finish(Status(StatusCode::CANCELLED, "Deadline exceeded or Client cancelled, abandoning"));
+            return;
+        }
+        this->chunk_sizer.Record(this->chunk_length, std::chrono::steady_clock::now() - this->write_start);
+        this->offset += this->chunk_length;
+        NextWrite();
+    }
+
+    void OnDone() override {
+        delete this;
+    }
+};
+
+/**
+ * Fill in the listing entry of a file from its indexed metadata
+ *
+ * @param file_name
+ * @param meta
+ * @param file_info
+ */
+static void dfs_set_file_info(const std::string &file_name, const DFSFileMeta &meta, FileInfo *file_info) {
+    file_info->set_name(file_name);
+    file_info->set_mdf_time(static_cast<long>(meta.mtime_ns / 1000000000));
+    file_info->set_crt_time(meta.ctime);
+    file_info->set_file_size(meta.size);
+}
+
+/**
+ * Fill in a listing of the files changed since a version; files gone
+ * from the snapshot are listed as deleted
+ *
+ * @param changes
+ * @param file_list
+ */
+static void dfs_set_changes(const DFSDirChanges &changes, FileList *file_list) {
+    for (const std::string &file_name : changes.file_names) {
+        auto file_iter = changes.snapshot->files.find(file_name);
+        if (file_iter == changes.snapshot->files.end()) {
+            FileInfo *file_info = file_list->add_files();
+            file_info->set_name(file_name);
+            file_info->set_deleted(true);
+        }
+        else {
+            dfs_set_file_info(file_name, file_iter->second, file_list->add_files());
+        }
+    }
+    file_list->set_version(changes.snapshot->version);
+    file_list->set_full(changes.full);
+}
+
+/**
+ * Streams listings of what changed in the mount to one client for Watch.
+ *
+ * The first listing has everything changed since the request's version
+ * (every file for version 0); after that the watch hub notifies the
+ * reactor of each change. A listing is only built when it can be written,
+ * from the version the last one reached, so changes that come in while a
+ * write is in flight are sent together in the next. The reactor leaves
+ * the hub and deletes itself once gRPC is done with the call.
+ */
+class DFSWatchReactor : public grpc::ServerWriteReactor<FileList>, public DFSWatchSubscriber {
+
+private:
+    DFSMetadataIndex *metadata_index;
+    DFSWatchHub *watch_hub;
+
+    /** Guards the state below, which gRPC's and the hub's threads share **/
+    std::mutex mutex;
+
+    /** Index version the last listing reached **/
+    std::uint64_t sent_version;
+
+    /** The listing being written **/
+    FileList listing;
+
+    bool writing;
+
+    /** Whether a change came in during the write in flight **/
+    bool pending;
+
+    /** Whether the client cancelled, so the write in flight is the last **/
+    bool cancelled;
+
+    bool finished;
+
+    /** Send what changed since the last listing; the mutex must be held **/
+    void WriteLocked() {
+        this->pending = false;
+        this->listing.Clear();
+        dfs_set_changes(this->metadata_index->Changes(this->sent_version), &this->listing);
+        this->sent_version = this->listing.version();
+        this->writing = true;
+        StartWrite(&this->listing);
+    }
+
+    void FinishLocked(const Status &status) {
+        if (!this->finished) {
+            this->finished = true;
+            Finish(status);
+        }
+    }
+
+public:
+    DFSWatchReactor(DFSMetadataIndex *metadata_index, DFSWatchHub *watch_hub, std::uint64_t since_version) :
+        metadata_index(metadata_index), watch_hub(watch_hub), sent_version(since_version), writing(false),
+        pending(false), cancelled(false), finished(false) {
+        this->watch_hub->Subscribe(this);
+        Notify();
+    }
+
+    bool Notify() override {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->finished) {
+            return true;
+        }
+        if (this->writing) {
+            this->pending = true;
+            return false;
+        }
+        WriteLocked();
+        return true;
+    }
+
+    void OnWriteDone(bool ok) override {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->writing = false;
+        if (!ok || this->cancelled) {
+            // A write in flight at the cancel may still complete ok, so the flag decides
+            dfs_log(LL_SYSINFO) << "Watching client went away";
+            FinishLocked(Status(StatusCode::CANCELLED, "Client cancelled the watch"));
+        }
+        else if (this->pending && !this->finished) {
+            WriteLocked();
+        }
+    }
+
+    void OnCancel() override {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->cancelled = true;
+        if (!this->writing) {
+            FinishLocked(Status(StatusCode::CANCELLED, "Client cancelled the watch"));
+        }
+        else {
+            // OnWriteDone finishes the call once the write in flight completes, ok or not
+            this->pending = false;
+        }
+    }
+
+    void OnDone() override {
+        this->watch_hub->Unsubscribe(this);
+        delete this;
+    }
+};
+
 //
 // STUDENT INSTRUCTION:
 //
@@ -66,15 +348,15 @@ extern dfs_log_level_e DFS_LOG_LEVEL;
 // - How will you release the write lock?
 // - How will you handle a store request for a client that doesn't have a write lock?
 // - When matching files to determine similarity, you should use the `file_checksum` method we've provided.
-//      - Both the client and server have a pre-made `crc_table` variable to speed things up.
 //      - Use the `file_checksum` method to compare two files, similar to the following:
 //
-//          std::uint32_t server_crc = dfs_file_checksum(filepath, &this->crc_table);
+//          std::uint32_t server_crc = dfs_file_checksum(filepath);
 //
 //      - Hint: as the crc checksum is a simple integer, you can pass it around inside your message types.
 //
 class DFSServiceImpl final :
-    public DFSService::WithAsyncMethod_CallbackList<DFSService::Service>,
+    public DFSService::WithCallbackMethod_Watch<
+        DFSService::WithRawCallbackMethod_FetchFile<DFSService::WithAsyncMethod_CallbackList<DFSService::Service>>>,
         public DFSCallDataManager<FileRequestType , FileListResponseType> {
 
 private:
@@ -88,23 +370,44 @@ private:
     /** Mutex for managing the queue requests **/
     std::mutex queue_mutex;
 
+    /** Wakes the queue thread for a new request, a parked callback or a change of the mount **/
+    std::condition_variable queue_cv;
+
+    /** A callback held back until the mount changes past what its client has seen **/
+    struct ParkedCallback {
+        ServerContext* context;
+        FileRequestType* request;
+        FileListResponseType* response;
+        std::function<void()> finish;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    /** Callbacks waiting for a change or their heartbeat, guarded by the queue mutex **/
+    std::vector<ParkedCallback> parked_callbacks;
+
     /** The vector of queued tags used to manage asynchronous requests **/
     std::vector<QueueRequest<FileRequestType, FileListResponseType>> queued_tags;
 
-    /* Server Directory Mutex */
-    std::mutex dir_mutex;
+    /** The per-file mutexes and write locks **/
+    DFSLockTable locks;
+
+    /** Whether stored files are fsync'd before they replace the live file **/
+    bool sync_writes;
+
+    /** Where each chunk of the files in the mount can be read from **/
+    DFSChunkIndex chunk_index;
 
-    /* Map from file to current-owned client */
-    std::map<std::string, std::string> file_client_map;
+    /** Checksums of the files in the mount, kept until a file changes **/
+    DFSChecksumCache checksum_cache;
 
-    /* Mutex of controlling the file-client map */
-    std::mutex file_client_map_mutex;
+    /** Size and times of the files in the mount, served to listings **/
+    DFSMetadataIndex metadata_index;
 
-    /* Map from file to its mutex */
-    std::map<std::string, std::unique_ptr<std::mutex>> file_mutex_map;
+    /** Keeps the metadata index current when other processes change the mount **/
+    DFSMountWatcher mount_watcher;
 
-    /* Mutex of controlling the file-mutex map */
-    std::mutex file_mutex_map_mutex;
+    /** Pushes changes of the metadata index to the clients streaming Watch **/
+    DFSWatchHub watch_hub;
 
     /**
      * Prepend the mount path to the filename.
@@ -116,18 +419,104 @@ private:
         return this->mount_path + filepath;
     }
 
-    /** CRC Table kept in memory for faster calculations **/
-    CRC::Table<std::uint32_t, 32> crc_table;
+    /**
+     * Path of the hidden partial file a store is written to
+     *
+     * @param file_name
+     * @return
+     */
+    const std::string PartPath(const std::string &file_name) {
+        return this->mount_path + dfs_part_name(file_name);
+    }
+
+    /**
+     * Path of the checkpoint kept next to the partial file of an upload
+     *
+     * @param file_name
+     * @return
+     */
+    const std::string ResumePath(const std::string &file_name) {
+        return this->mount_path + dfs_resume_name(file_name);
+    }
+
+    /**
+     * Flush a file or directory to disk
+     *
+     * @param path
+     * @return bool
+     */
+    bool SyncFile(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+        bool synced = fsync(fd) == 0;
+        close(fd);
+        return synced;
+    }
+
+    /**
+     * Move a finished partial file over the live one.
+     *
+     * Fetches read from the file they opened, so they keep serving the
+     * old version and never wait for an upload; the file's lock only
+     * covers the rename itself. The rename happens under the lock table,
+     * only while the client still holds its write lease, so an upload that
+     * outlived its lease can't overwrite the store of the next owner. The
+     * new copy is indexed from `chunks` when the upload named them, and
+     * hashed in the background otherwise.
+     *
+     * @param file_name
+     * @param client_id
+     * @param part_path
+     * @param chunks the chunks of the file in order, or NULL
+     * @return StatusCode ABORTED if the lease was gone, INTERNAL if the rename failed
+     */
+    StatusCode ReplaceFile(const std::string &file_name, const std::string &client_id, const std::string &part_path,
+                           const std::vector<std::pair<std::string, size_t>> *chunks = NULL) {
+        {
+            std::lock_guard<DFSSharedMutex> lock(this->locks.FileMutex(file_name));
+            bool renamed = false;
+            if (!this->locks.CommitIfHolder(file_name, client_id, [&] {
+                    renamed = rename(part_path.c_str(), WrapPath(file_name).c_str()) == 0;
+                })) {
+                return StatusCode::ABORTED;
+            }
+            if (!renamed) {
+                return StatusCode::INTERNAL;
+            }
+            this->checksum_cache.Invalidate(WrapPath(file_name));
+        }
+
+        // Persist the new directory entry as well as the data
+        bool synced = !this->sync_writes || SyncFile(this->mount_path);
+        if (chunks != NULL) {
+            this->chunk_index.SetFile(file_name, *chunks);
+        }
+        else {
+            this->chunk_index.QueueFile(file_name);
+        }
+        return synced ? StatusCode::OK : StatusCode::INTERNAL;
+    }
 
 public:
 
-    DFSServiceImpl(const std::string& mount_path, const std::string& server_address, int num_async_threads):
-        mount_path(mount_path), crc_table(CRC::CRC_32()) {
+    DFSServiceImpl(const std::string& mount_path, const std::string& server_address, int num_async_threads,
+                   bool sync_writes, bool persist_checksums, long lease_ms):
+        mount_path(mount_path), locks(lease_ms), sync_writes(sync_writes), chunk_index(mount_path),
+        metadata_index(mount_path), mount_watcher(mount_path), watch_hub(DFS_CALLBACK_HEARTBEAT_MS) {
+
+        if (persist_checksums) {
+            this->checksum_cache.Persist(WrapPath(DFS_CHECKSUM_CACHE_NAME));
+        }
 
         this->runner.SetService(this);
         this->runner.SetAddress(server_address);
         this->runner.SetNumThreads(num_async_threads);
         this->runner.SetQueuedRequestsCallback([&]{ this->ProcessQueuedRequests(); });
+        this->runner.SetBulkCallback([&](DFSBulkServerCall *call){ this->ProcessBulkCall(call); });
+        dfs_log(LL_SYSINFO) << "Checksum engine: CRC-32C " << dfs_crc32c_engine();
+        dfs_log(LL_SYSINFO) << "Write lock lease: " << lease_ms << " ms";
 
         /* Traverse the entire directory, make the map for all files and their file-specific mutex */
         DIR *dir;
@@ -140,16 +529,42 @@ public:
                 }
 
                 std::string file_name(ent->d_name);
-                file_mutex_map[file_name] = std::make_unique<std::mutex>();
                 std::string file_path = WrapPath(file_name);
                 dfs_log(LL_SYSINFO) << "Found File: " << file_path;
+
+                if (file_name[0] != '.') {
+                    this->chunk_index.AddFile(file_name);
+                }
             }
             closedir(dir);
+            dfs_log(LL_SYSINFO) << "Chunk index: " << this->chunk_index.Stats();
         }
         else {
             std::string error_msg = "Server failed to open directory";
             dfs_log(LL_ERROR) << error_msg;           
         }
+
+        // Queued callbacks wait for the index to move; taking the queue mutex
+        // first means the queue thread is either before its check or waiting
+        this->metadata_index.SetChangeCallback([this] {
+            { std::lock_guard<std::mutex> lock(this->queue_mutex); }
+            this->queue_cv.notify_one();
+            this->watch_hub.Publish();
+        });
+
+        // Watch before the first read, so no change falls between the two
+        this->mount_watcher.Start([this](const std::vector<std::string> &file_names, bool overflow) {
+            if (overflow) {
+                this->metadata_index.Rebuild();
+            }
+            else {
+                this->metadata_index.Update(file_names);
+            }
+            dfs_log(LL_DEBUG) << "Mount watcher: " << this->mount_watcher.Stats() << "; metadata index: "
+                              << this->metadata_index.Stats();
+        });
+        this->metadata_index.Rebuild();
+        dfs_log(LL_SYSINFO) << "Metadata index: " << this->metadata_index.Stats();
     }
 
     ~DFSServiceImpl() {
@@ -182,6 +597,7 @@ public:
 
         std::lock_guard<std::mutex> lock(queue_mutex);
         this->queued_tags.emplace_back(context, request, response, cq, tag);
+        this->queue_cv.notify_one();
 
     }
 
@@ -219,6 +635,32 @@ public:
 
     }
 
+    /**
+     * Park a callback whose client is up to date
+     *
+     * A client that sends the version it last saw gets no reply until the
+     * mount moves past it, or until DFS_CALLBACK_HEARTBEAT_MS passes so it
+     * can tell the server is still there. Anything else is answered at once.
+     *
+     * @param context
+     * @param request
+     * @param response
+     * @param finish
+     * @return bool true if the queue thread will answer the callback
+     */
+    bool DeferCallback(ServerContext* context, FileRequestType* request, FileListResponseType* response,
+                       const std::function<void()>& finish) {
+        if (request->since_version() == 0 || request->since_version() != this->metadata_index.Version()) {
+            return false;
+        }
+
+        // A change racing the check above is caught by the queue thread's own check
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        this->parked_callbacks.push_back({context, request, response, finish, std::chrono::steady_clock::now()});
+        this->queue_cv.notify_one();
+        return true;
+    }
+
     /**
      * Processes the queued requests in the queue thread
      */
@@ -239,8 +681,7 @@ public:
             // Guarded section for queue
             {
                 dfs_log(LL_DEBUG2) << "Waiting for queue guard";
-                std::lock_guard<std::mutex> lock(queue_mutex);
-
+                std::unique_lock<std::mutex> lock(queue_mutex);
 
                 for(QueueRequest<FileRequestType, FileListResponseType>& queue_request : this->queued_tags) {
                     this->RequestCallbackList(queue_request.context, queue_request.request,
@@ -255,6 +696,39 @@ public:
                     [](QueueRequest<FileRequestType, FileListResponseType>& queue_request) { return queue_request.finished; }
                 ), this->queued_tags.end());
 
+                // Answer the parked callbacks whose client is behind or due a heartbeat
+                std::uint64_t version = this->metadata_index.Version();
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                std::chrono::steady_clock::time_point wake = now + std::chrono::milliseconds(DFS_CALLBACK_HEARTBEAT_MS);
+                std::vector<ParkedCallback> ready;
+                auto parked = this->parked_callbacks.begin();
+                while (parked != this->parked_callbacks.end()) {
+                    std::chrono::steady_clock::time_point heartbeat =
+                        parked->since + std::chrono::milliseconds(DFS_CALLBACK_HEARTBEAT_MS);
+                    if (parked->request->since_version() == version && heartbeat > now) {
+                        wake = std::min(wake, heartbeat);
+                        ++parked;
+                        continue;
+                    }
+                    ready.push_back(std::move(*parked));
+                    parked = this->parked_callbacks.erase(parked);
+                }
+
+                if (ready.empty()) {
+                    // Sleep until a request arrives, a callback parks, the mount changes or a heartbeat is due
+                    size_t parked_count = this->parked_callbacks.size();
+                    this->queue_cv.wait_until(lock, wake, [&] {
+                        return !this->queued_tags.empty() || this->parked_callbacks.size() != parked_count ||
+                               this->metadata_index.Version() != version;
+                    });
+                    continue;
+                }
+                lock.unlock();
+
+                for (ParkedCallback& callback : ready) {
+                    this->ProcessCallback(callback.context, callback.request, callback.response);
+                    callback.finish();
+                }
             }
         }
     }
@@ -267,99 +741,453 @@ public:
     //
     
     Status StoreFile(ServerContext *context, 
-            ServerReader<FileData> *server_reader, FileInfo *return_file_info) override {
-        FileData file_data;
+            ServerReader<StoreRequest> *server_reader, FileInfo *return_file_info) override {
+        StoreRequest store_request;
 
         /* 1. Receive file information: file nama, file mtime, client id, etc. */
-        std::string file_name;
-        std::string client_id;
-        long mdf_time;
-        long client_crc;
-        try {
-            server_reader->Read(&file_data);
-            file_name = file_data.data();
-            server_reader->Read(&file_data);
-            client_id = file_data.data();
-            server_reader->Read(&file_data);
-            mdf_time = stol(file_data.data());
-            server_reader->Read(&file_data);
-            client_crc = stol(file_data.data());
-        } catch (std::exception const &e){
-            std::stringstream str_str;
-            str_str << "Improper file info for file name/client ID/modified time/clietn CRC: " << e.what() << std::endl;
-            dfs_log(LL_ERROR) << str_str.str();
-            return Status(StatusCode::INTERNAL, str_str.str());
+        if (!server_reader->Read(&store_request) || !store_request.has_header()) {
+            std::string error_msg = "Store request is missing its file header";
+            dfs_log(LL_ERROR) << error_msg;
+            return Status(StatusCode::INVALID_ARGUMENT, error_msg);
+        }
+
+        // The client waits for the initial metadata before sending the body,
+        // so a rejected upload costs one round-trip and no payload bytes
+        return this->ReceiveFile(context, store_request.header(), [&](size_t resume_offset) {
+            context->AddInitialMetadata(DFS_CHUNK_SIZE_KEY, std::to_string(DFS_MAX_CHUNK_SIZE));
+            context->AddInitialMetadata(DFS_RESUME_OFFSET_KEY, std::to_string(resume_offset));
+            server_reader->SendInitialMetadata();
+        }, [&](const ChunkWriter &write_chunk) {
+            if (!server_reader->Read(&store_request)) {
+                return false;
+            }
+            const std::string &data = store_request.chunk();
+            return write_chunk(data.data(), data.size());
+        }, return_file_info);
+    }
+
+    Status StoreDelta(ServerContext *context,
+            ServerReaderWriter<DeltaResponse, DeltaRequest> *stream) override {
+        DeltaRequest delta_request;
+        if (!stream->Read(&delta_request) || !delta_request.has_header()) {
+            std::string error_msg = "Delta request is missing its file header";
+            dfs_log(LL_ERROR) << error_msg;
+            return Status(StatusCode::INVALID_ARGUMENT, error_msg);
+        }
+        RequestFile header = delta_request.header();
+
+        std::shared_ptr<DFSReadFile> base;
+        std::string copy_data;
+        bool base_changed = false;
+        size_t block_size = 0, block_count = 0;
+        size_t rebuilt = 0, resume_from = 0;
+        bool bad_request = false;
+        DeltaResponse response;
+        FileInfo file_info;
+
+        Status status = this->ReceiveFile(context, header, [&](size_t resume_offset) {
+            // The client holds the write lock and stores replace the file by
+            // rename, so this mapping stays the base for the whole call
+            base = DFSReadFile::Open(WrapPath(header.name()));
+            SignatureList *signatures = response.mutable_signatures();
+            if (!base || !dfs_block_signatures(*base, signatures)) {
+                // No base to copy from, the client sends the whole file as literals
+                signatures->Clear();
+                signatures->set_block_size(dfs_delta_block_size(0));
+            }
+            block_size = response.signatures().block_size();
+            block_count = response.signatures().blocks_size();
+            resume_from = resume_offset;
+
+            context->AddInitialMetadata(DFS_CHUNK_SIZE_KEY, std::to_string(DFS_MAX_CHUNK_SIZE));
+            stream->Write(response);
+        }, [&](const ChunkWriter &write_chunk) {
+            if (!stream->Read(&delta_request)) {
+                return false;
+            }
+
+            // Bytes an interrupted upload already stored are rebuilt, not rewritten
+            auto rebuild = [&](const char *data, size_t length) {
+                size_t stored = rebuilt < resume_from ? std::min(length, resume_from - rebuilt) : 0;
+                rebuilt += length;
+                return stored == length || write_chunk(data + stored, length - stored);
+            };
+
+            if (delta_request.has_copy()) {
+                const BlockRun &run = delta_request.copy();
+                if (run.first() < 0 || run.count() <= 0 ||
+                        static_cast<size_t>(run.first() + run.count()) > block_count) {
+                    bad_request = true;
+                    return false;
+                }
+
+                // A run can span most of the file, so it is copied a piece at a time
+                size_t start = run.first() * block_size;
+                size_t end = std::min(start + run.count() * block_size, base->Size());
+                for (size_t offset = start; offset < end; offset += copy_data.size()) {
+                    copy_data.resize(std::min<size_t>(end - offset, DFS_MAX_CHUNK_SIZE));
+                    if (!base->Read(offset, copy_data.size(), &copy_data[0])) {
+                        base_changed = true;
+                        return false;
+                    }
+                    if (!rebuild(copy_data.data(), copy_data.size())) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+            if (delta_request.request_case() == DeltaRequest::kLiteral) {
+                return rebuild(delta_request.literal().data(), delta_request.literal().size());
+            }
+            bad_request = true;
+            return false;
+        }, &file_info);
+
+        if (base_changed) {
+            std::string error_msg = "Server copy of " + header.name() + " changed during the delta upload";
+            dfs_log(LL_ERROR) << error_msg;
+            return Status(StatusCode::ABORTED, error_msg);
+        }
+        if (bad_request) {
+            std::string error_msg = "Delta for " + header.name() + " refers to blocks the server does not have";
+            dfs_log(LL_ERROR) << error_msg;
+            return Status(StatusCode::INVALID_ARGUMENT, error_msg);
+        }
+        if (status.ok()) {
+            *response.mutable_file_info() = file_info;
+            stream->Write(response);
+        }
+        return status;
+    }
+
+    Status HaveChunks(ServerContext *context, const ChunkList *request, ChunkList *response) override {
+        for (const ChunkRef &chunk : request->chunks()) {
+            if (this->chunk_index.Has(chunk.id())) {
+                *response->add_chunks() = chunk;
+            }
+        }
+        return Status::OK;
+    }
+
+    Status StoreChunks(ServerContext *context,
+            ServerReader<ChunkRequest> *server_reader, FileInfo *return_file_info) override {
+        ChunkRequest chunk_request;
+        if (!server_reader->Read(&chunk_request) || !chunk_request.has_header()) {
+            std::string error_msg = "Chunk request is missing its file header";
+            dfs_log(LL_ERROR) << error_msg;
+            return Status(StatusCode::INVALID_ARGUMENT, error_msg);
+        }
+        RequestFile header = chunk_request.header();
+        std::string part_path = PartPath(header.name());
+
+        // Chunks sent earlier in this upload, by their offset in the partial file
+        std::unordered_map<std::string, size_t> received;
+
+        // Every chunk of the file in order, so it is indexed without hashing it again
+        std::vector<std::pair<std::string, size_t>> chunk_list;
+        std::string chunk_data;
+        size_t rebuilt = 0, resume_from = 0, uploaded = 0;
+        std::string missing_chunk, bad_chunk;
+        auto start_time = std::chrono::steady_clock::now();
+
+        Status status = this->ReceiveFile(context, header, [&](size_t resume_offset) {
+            resume_from = resume_offset;
+            context->AddInitialMetadata(DFS_CHUNK_SIZE_KEY, std::to_string(DFS_MAX_CHUNK_SIZE));
+            server_reader->SendInitialMetadata();
+        }, [&](const ChunkWriter &write_chunk) {
+            if (!server_reader->Read(&chunk_request)) {
+                return false;
+            }
+            if (!chunk_request.has_batch()) {
+                bad_chunk = "Chunk request carries no chunks";
+                return false;
+            }
+
+            for (const ChunkPiece &piece : chunk_request.batch().pieces()) {
+                const char *data;
+                size_t length;
+                if (piece.has_chunk()) {
+                    const std::string &body = piece.chunk().data();
+                    if (dfs_chunk_id(body.data(), body.size()) != piece.chunk().id()) {
+                        bad_chunk = "Chunk body does not match its ID";
+                        return false;
+                    }
+                    received[piece.chunk().id()] = rebuilt;
+                    uploaded += body.size();
+                    data = body.data();
+                    length = body.size();
+                    chunk_list.push_back({piece.chunk().id(), length});
+                }
+                else if (piece.has_ref()) {
+                    const ChunkRef &ref = piece.ref();
+                    if (ref.length() <= 0 || ref.length() > DFS_CDC_MAX_CHUNK) {
+                        bad_chunk = "Chunk reference has an invalid length";
+                        return false;
+                    }
+                    auto received_iter = received.find(ref.id());
+                    bool found = false;
+                    if (received_iter != received.end()) {
+                        chunk_data.resize(ref.length());
+                        int fd = open(part_path.c_str(), O_RDONLY);
+                        found = fd != -1 && pread(fd, &chunk_data[0], ref.length(), received_iter->second) ==
+                                                    static_cast<ssize_t>(ref.length());
+                        if (fd != -1) {
+                            close(fd);
+                        }
+                    }
+                    if (!found && !this->chunk_index.Read(ref.id(), &chunk_data)) {
+                        missing_chunk = "Server no longer holds a referenced chunk";
+                        return false;
+                    }
+                    data = chunk_data.data();
+                    length = chunk_data.size();
+                    chunk_list.push_back({ref.id(), length});
+                }
+                else {
+                    bad_chunk = "Chunk request carries an empty piece";
+                    return false;
+                }
+
+                // Bytes an interrupted upload already stored are rebuilt, not rewritten
+                size_t stored = rebuilt < resume_from ? std::min(length, resume_from - rebuilt) : 0;
+                rebuilt += length;
+                if (stored < length && !write_chunk(data + stored, length - stored)) {
+                    return false;
+                }
+            }
+            return true;
+        }, return_file_info, &chunk_list);
+
+        if (!bad_chunk.empty()) {
+            dfs_log(LL_ERROR) << bad_chunk << " for " << header.name();
+            return Status(StatusCode::INVALID_ARGUMENT, bad_chunk);
         }
+        if (!missing_chunk.empty()) {
+            dfs_log(LL_ERROR) << missing_chunk << " for " << header.name();
+            return Status(StatusCode::FAILED_PRECONDITION, missing_chunk);
+        }
+        if (status.ok()) {
+            dfs_log(LL_SYSINFO) << "Chunked store of " << header.name() << ": " << rebuilt << " bytes, "
+                                << uploaded << " uploaded, " << rebuilt - uploaded << " reused, at "
+                                << dfs_megabytes_per_second(rebuilt, std::chrono::steady_clock::now() - start_time)
+                                << " MB/s; index: " << this->chunk_index.Stats();
+        }
+        return status;
+    }
+
+    /** Writes a received chunk at the current position, false on a write error **/
+    using ChunkWriter = std::function<bool(const char *, size_t)>;
+
+    /**
+     * Store the body of an upload once its header has been read.
+     *
+     * Shared by the typed and bulk StoreFile calls. `accept` tells the
+     * client to start sending the body once the header checks pass.
+     * `read_chunk` hands the next chunk of the body to its writer, and
+     * returns false once the client has nothing more to send.
+     *
+     * A whole-file upload is written into a partial file with a checkpoint
+     * of how far it got. If it breaks off, the next upload of the same
+     * content resumes at the checkpoint, which `accept` is given so it can
+     * tell the client where to continue from.
+     *
+     * A header with a length is one stripe of a striped store: stripes are
+     * written into a partial file at their offset, and a final commit
+     * header moves the partial file into place.
+     *
+     * @param context NULL for bulk calls, whose async context can't be polled for cancellation
+     * @param header
+     * @param accept
+     * @param read_chunk
+     * @param return_file_info
+     * @param chunks the chunks a chunked upload was rebuilt from, complete once `read_chunk` is done, or NULL
+     * @return Status
+     */
+    Status ReceiveFile(ServerContext *context, const RequestFile &header, const std::function<void(size_t)> &accept,
+            const std::function<bool(const ChunkWriter&)> &read_chunk, FileInfo *return_file_info,
+            const std::vector<std::pair<std::string, size_t>> *chunks = NULL) {
+        std::string file_name = header.name();
+        std::string client_id = header.request_client_id();
+        long mdf_time = header.request_mdf_time();
+        long client_crc = header.client_file_crc();
+        bool striped = header.length() > 0;
 
         /* 2. Check if the file has a client owned */
         std::string file_path = WrapPath(file_name);
 
-        file_client_map_mutex.lock();
-        auto file_client_iter = file_client_map.find(file_name);
-        if ((file_client_iter == file_client_map.end()) || ((file_client_iter->second).compare(client_id) != 0)) {
+        // A one-step store locks the file as it opens, the lock goes on every way out below
+        if (header.take_lock() && !header.commit()) {
+            Status lock_status = this->GrantWriteLock(context, header);
+            if (!lock_status.ok()) {
+                return lock_status;
+            }
+        }
+
+        if (!this->locks.HoldsWrite(file_name, client_id)) {
             std::stringstream str_str;
             str_str << client_id << " has no write lock for " << file_name << ", or the file has already been locked" << std::endl;
             dfs_log(LL_SYSINFO) << str_str.str();
-            file_client_map_mutex.unlock();
             return Status(StatusCode::INTERNAL, str_str.str());
         }
-        file_client_map_mutex.unlock();
 
-        // Get mutex for the file
-        file_mutex_map_mutex.lock();
-        auto file_mutex_iter = file_mutex_map.find(file_name);
-        std::mutex *file_mutex = file_mutex_iter->second.get();
-        file_mutex_map_mutex.unlock();
+        if (header.commit()) {
+            return this->CommitStripes(header, return_file_info);
+        }
 
-        /* 3. Perform CRC check */
-        std::lock_guard<std::mutex> lock(dir_mutex);
-        std::lock_guard<std::mutex> lock2(*(file_mutex)); 
+        /* 3. Perform CRC check, once per upload: stripes after the first skip it */
+        if (header.offset() == 0) {
+            // The body goes to a partial file, so the lock only covers the check
+            std::lock_guard<DFSSharedMutex> lock(this->locks.FileMutex(file_name));
 
-        long server_crc = dfs_file_checksum(file_path, &this->crc_table);
-        if (server_crc == client_crc) {
-            std::string msg1 = "File already exists";
-            dfs_log(LL_SYSINFO) << msg1 << " for: " << file_name;
+            long server_crc = this->checksum_cache.Checksum(file_path);
+            dfs_log(LL_DEBUG) << "Checksum cache: " << this->checksum_cache.Stats();
+            if (server_crc == client_crc) {
+                std::string msg1 = "File already exists";
+                dfs_log(LL_SYSINFO) << msg1 << " for: " << file_name;
 
-            struct stat st;
-            stat(file_path.c_str(), &st);
-            long s_mdf_time = static_cast<long> (st.st_mtim.tv_sec);
+                struct stat st;
+                stat(file_path.c_str(), &st);
+                long s_mdf_time = static_cast<long> (st.st_mtim.tv_sec);
+
+                if (s_mdf_time < mdf_time) {
+                    std::string msg = "Client modified time greater than server, now updating";
+                    dfs_log(LL_SYSINFO) << msg;
+
+                    struct utimbuf new_times;
+                    new_times.actime = st.st_atime;
+                    new_times.modtime = mdf_time;   
+                    utime(file_path.c_str(), &new_times);
+                    this->checksum_cache.Put(file_path, server_crc);
+                    this->metadata_index.Update(file_name, server_crc);
+                }
 
-            if (s_mdf_time < mdf_time) {
-                std::string msg = "Client modified time greater than server, now updating";
-                dfs_log(LL_SYSINFO) << msg;
+                this->locks.ReleaseWrite(file_name, client_id);
+                return Status(StatusCode::ALREADY_EXISTS, msg1);
+            }
+        }
 
-                struct utimbuf new_times;
-                new_times.actime = st.st_atime;
-                new_times.modtime = mdf_time;   
-                utime(file_path.c_str(), &new_times);
+        /* 4. Store file data in server */
+        std::string part_path = PartPath(file_name);
+        std::string resume_path = ResumePath(file_name);
+        DFSResumePoint resume;
+        if (!striped) {
+            // Pick up an interrupted upload of the same content where it stopped
+            std::string upload = std::to_string(client_crc) + ":" + std::to_string(header.file_size());
+            if (!resume.Load(resume_path) || resume.version != upload ||
+                    resume.offset > static_cast<size_t>(header.file_size()) ||
+                    !resume.Matches(part_path)) {
+                resume = DFSResumePoint();
+                resume.version = upload;
             }
+        }
 
-            file_mutex_map_mutex.lock();
-            file_client_map.erase(file_name); 
-            file_mutex_map_mutex.unlock();
-            return Status(StatusCode::ALREADY_EXISTS, msg1);
+        // The first stripe sizes the partial file before the others are let in
+        int fd = open(part_path.c_str(), striped && header.offset() > 0 ? O_WRONLY : O_WRONLY | O_CREAT, 0644);
+        if (fd != -1 && (!striped || header.offset() == 0) &&
+                ftruncate(fd, striped ? header.file_size() : resume.offset) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd == -1) {
+            std::stringstream str_stream;
+            str_stream << "Server failed to open " << file_name << " for writing: " << strerror(errno);
+            dfs_log(LL_ERROR) << str_stream.str();
+            this->locks.ReleaseWrite(file_name, client_id);
+            return Status(StatusCode::FAILED_PRECONDITION, str_stream.str());
         }
 
-        /* 4. Store file data in server */
-        std::ofstream ofs;
-        dfs_log(LL_SYSINFO) << "Server starts storing data to file: " << file_name;
-        
-        while (server_reader->Read(&file_data)) {
-            if (context->IsCancelled()) {
+        off_t position = striped ? header.offset() : resume.offset;
+        bool resumed = !striped && resume.offset > 0;
+        dfs_log(LL_SYSINFO) << "Server starts storing data to file: " << file_name << " at offset " << position;
+        accept(resume.offset);
+
+        bool write_ok = true;
+        ChunkWriter write_chunk = [&](const char *data, size_t size) {
+            ssize_t written = pwrite(fd, data, size, position);
+            write_ok = written == static_cast<ssize_t>(size);
+            if (write_ok) {
+                position += size;
+                if (!striped) {
+                    resume.Advance(data, size);
+                    resume.Checkpoint(resume_path);
+                }
+            }
+            return write_ok;
+        };
+
+        while (read_chunk(write_chunk)) {
+            if (context != NULL && context->IsCancelled()) {
                 std::string error_msg = "Deadline exceeded or Client cancelled, abandoning";
                 dfs_log(LL_ERROR) << error_msg;
-                std::lock_guard<std::mutex> lock(file_client_map_mutex);
-                file_client_map.erase(file_name); 
+                close(fd);
+                // Checkpoints are throttled, so record exactly how far the upload got
+                if (!striped) {
+                    resume.Save(resume_path);
+                }
+                this->locks.ReleaseWrite(file_name, client_id);
                 return Status(StatusCode::DEADLINE_EXCEEDED, error_msg);
             }
+        }
+        if (write_ok && this->sync_writes && fsync(fd) != 0) {
+            write_ok = false;
+        }
+        close(fd);
 
-            if (!ofs.is_open()) {
-                ofs.open(file_path, std::ios::trunc);
-            }
+        if (!write_ok) {
+            std::string error_msg = "Server failed to write " + file_name + ": " + strerror(errno);
+            dfs_log(LL_ERROR) << error_msg;
+            this->locks.ReleaseWrite(file_name, client_id);
+            return Status(StatusCode::INTERNAL, error_msg);
+        }
 
-            std::string data = file_data.data();
-            ofs << data;            
+        if (striped) {
+            // The write lock is kept until the commit
+            return_file_info->set_name(file_name);
+            return_file_info->set_file_size(position - header.offset());
+            return Status::OK;
         }
+
+        if (header.file_size() > 0 && position != header.file_size()) {
+            std::stringstream str_stream;
+            str_stream << "Upload of " << file_name << " stopped at " << position << " of "
+                       << header.file_size() << " bytes, keeping it to resume";
+            dfs_log(LL_ERROR) << str_stream.str();
+            resume.Save(resume_path);
+            this->locks.ReleaseWrite(file_name, client_id);
+            return Status(StatusCode::CANCELLED, str_stream.str());
+        }
+
+        // The CRC was taken over the bytes as they were written, including
+        // any resumed prefix, so every upload is checked without reading it back
+        if (static_cast<long>(resume.crc) != client_crc) {
+            std::string error_msg = (resumed || header.delta() ? "Rebuilt upload of " : "Upload of ") + file_name +
+                                    " does not match the client's CRC";
+            dfs_log(LL_ERROR) << error_msg;
+            unlink(part_path.c_str());
+            unlink(resume_path.c_str());
+            this->locks.ReleaseWrite(file_name, client_id);
+            return Status(StatusCode::DATA_LOSS, error_msg);
+        }
+
+        // Another client may own the file by now if this upload outlived its lease
+        StatusCode replaced = this->ReplaceFile(file_name, client_id, part_path, chunks);
+        if (replaced == StatusCode::ABORTED) {
+            std::string error_msg = "Write lock of " + file_name + " expired before the upload finished";
+            dfs_log(LL_ERROR) << error_msg;
+            unlink(part_path.c_str());
+            unlink(resume_path.c_str());
+            return Status(StatusCode::ABORTED, error_msg);
+        }
+        if (replaced != StatusCode::OK) {
+            std::string error_msg = "Server failed to move " + file_name + " into place: " + strerror(errno);
+            dfs_log(LL_ERROR) << error_msg;
+            this->locks.ReleaseWrite(file_name, client_id);
+            return Status(StatusCode::INTERNAL, error_msg);
+        }
+        unlink(resume_path.c_str());
+        this->checksum_cache.Put(file_path, resume.crc);
+        this->metadata_index.Update(file_name, resume.crc);
+
         struct stat st;
         stat(file_path.c_str(), &st);
         dfs_log(LL_SYSINFO) << "Server successfully stored data of size " << st.st_size;
@@ -372,31 +1200,128 @@ public:
         return_file_info->set_file_size(st.st_size);
         
         /* 5. Remove allocated write lock */
-        std::lock_guard<std::mutex> lock3(file_client_map_mutex);
-        file_client_map.erase(file_name);       
+        this->locks.ReleaseWrite(file_name, client_id);
         return Status::OK;
     }
-    
 
-    Status FetchFile(ServerContext *context,
-            const RequestFile *request_file, ServerWriter<FileData> *server_writer) override {
-        std::string file_name = request_file->name();
-        std::string client_id = request_file->request_client_id();
-        long mdf_time = request_file->request_mdf_time();
-        long client_crc = request_file->client_file_crc();
+    /**
+     * Finish a striped store by moving the partial file into place.
+     *
+     * The CRC of the partial file must match the client's, which also
+     * catches stripes that never arrived. The write lock is released
+     * either way.
+     *
+     * @param header
+     * @param return_file_info
+     * @return Status
+     */
+    Status CommitStripes(const RequestFile &header, FileInfo *return_file_info) {
+        std::string file_name = header.name();
+        std::string client_id = header.request_client_id();
         std::string file_path = WrapPath(file_name);
-        
-        /* 1. Ensure the file has corresponding write lock */
-        file_mutex_map_mutex.lock();
-        if (file_mutex_map.find(file_name) == file_mutex_map.end()) {
-            file_mutex_map[file_name] = std::make_unique<std::mutex>();
+        std::string part_path = PartPath(file_name);
+        Status status = Status::OK;
+        StatusCode replaced = StatusCode::OK;
+
+        struct stat st;
+        if (stat(part_path.c_str(), &st) != 0 || st.st_size != header.file_size() ||
+                static_cast<long>(dfs_file_checksum(part_path)) != header.client_file_crc()) {
+            dfs_log(LL_ERROR) << "Striped store of " << file_name << " is incomplete, discarding it";
+            unlink(part_path.c_str());
+            status = Status(StatusCode::DATA_LOSS, "Striped store is incomplete");
+        }
+        else if ((this->sync_writes && !SyncFile(part_path)) ||
+                 (replaced = this->ReplaceFile(file_name, client_id, part_path)) == StatusCode::INTERNAL) {
+            dfs_log(LL_ERROR) << "Server failed to commit " << file_name << ": " << strerror(errno);
+            unlink(part_path.c_str());
+            status = Status(StatusCode::INTERNAL, "Server failed to commit the file");
+        }
+        else if (replaced == StatusCode::ABORTED) {
+            dfs_log(LL_ERROR) << "Write lock of " << file_name << " expired before the commit, discarding it";
+            unlink(part_path.c_str());
+            status = Status(StatusCode::ABORTED, "Write lock expired before the commit");
+        }
+        else {
+            this->checksum_cache.Put(file_path, header.client_file_crc());
+            this->metadata_index.Update(file_name, header.client_file_crc());
+            stat(file_path.c_str(), &st);
+            dfs_log(LL_SYSINFO) << "Server successfully stored data of size " << st.st_size;
+            return_file_info->set_mdf_time(static_cast<long> (st.st_mtim.tv_sec));
+            return_file_info->set_crt_time(static_cast<long> (st.st_ctim.tv_sec));
+            return_file_info->set_name(file_name);
+            return_file_info->set_file_size(st.st_size);
         }
-        auto file_mutex_iter = file_mutex_map.find(file_name);
-        std::mutex *file_mutex = file_mutex_iter->second.get();
-        file_mutex_map_mutex.unlock();
 
+        this->locks.ReleaseWrite(file_name, client_id);
+        return status;
+    }
+    
+
+    grpc::ServerWriteReactor<grpc::ByteBuffer>* FetchFile(grpc::CallbackServerContext *context,
+            const grpc::ByteBuffer *request) override {
+        RequestFile request_file;
+        grpc::ByteBuffer request_buffer(*request);
+        if (!grpc::SerializationTraits<RequestFile>::Deserialize(&request_buffer, &request_file).ok()) {
+            dfs_log(LL_ERROR) << "Server failed to parse fetch request";
+            return new DFSFetchReactor(Status(StatusCode::INVALID_ARGUMENT, "Malformed fetch request"));
+        }
+
+        std::shared_ptr<DFSReadFile> read_file;
+        Status status = this->PrepareFetch(request_file, &read_file);
+        if (!status.ok()) {
+            return new DFSFetchReactor(status);
+        }
+
+        size_t start = request_file.offset();
+        size_t end = read_file->Size();
+        if (request_file.length() > 0) {
+            end = std::min(end, start + static_cast<size_t>(request_file.length()));
+        }
+        if (start > end) {
+            return new DFSFetchReactor(Status(StatusCode::OUT_OF_RANGE, "Requested range is past the end of the file"));
+        }
+
+        // Lets a striped fetch size the file and pin the version its other stripes read
+        context->AddInitialMetadata(DFS_FILE_SIZE_KEY, std::to_string(read_file->Size()));
+        context->AddInitialMetadata(DFS_FILE_VERSION_KEY, read_file->Version());
+        return new DFSFetchReactor(context, read_file, request_file.name(),
+                                   dfs_peer_chunk_limit(context->client_metadata()), start, end);
+    }
+
+    /**
+     * Check a fetch request and open the file to be sent.
+     *
+     * Shared by the typed and bulk FetchFile calls.
+     *
+     * @param request_file
+     * @param read_file set when the file should be sent
+     * @return Status
+     */
+    Status PrepareFetch(const RequestFile &request_file, std::shared_ptr<DFSReadFile> *read_file) {
+        std::string file_name = request_file.name();
+        std::string client_id = request_file.request_client_id();
+        long mdf_time = request_file.request_mdf_time();
+        long client_crc = request_file.client_file_crc();
+        std::string file_path = WrapPath(file_name);
+
+        // The first stripe of a ranged fetch already did the checks below,
+        // later stripes only make sure they read the same version of the file
+        if (request_file.offset() > 0) {
+            *read_file = DFSReadFile::Open(file_path);
+            if (!*read_file) {
+                dfs_log(LL_ERROR) << "Server failed to open " << file_path;
+                return Status(StatusCode::UNAVAILABLE, "Server failed to open file");
+            }
+            if ((*read_file)->Version() != request_file.file_version()) {
+                dfs_log(LL_ERROR) << "File changed between stripes: " << file_name;
+                return Status(StatusCode::ABORTED, "File changed between stripes");
+            }
+            return Status::OK;
+        }
         
-        std::lock_guard<std::mutex> lock(*file_mutex);
+        // Held only until the file is open; stores rename a new file into
+        // place, so the descriptor is unaffected for the rest of the transfer
+        std::shared_lock<DFSSharedMutex> lock(this->locks.FileMutex(file_name));
 
         /* 2. Check if the file is in server */
         struct stat st;
@@ -408,13 +1333,12 @@ public:
         }
         
         /* 3. Perform CRC checks */
-        int server_crc = dfs_file_checksum(file_name, &this->crc_table);
+        long server_crc = this->checksum_cache.Checksum(file_path);
+        dfs_log(LL_DEBUG) << "Checksum cache: " << this->checksum_cache.Stats();
         if (server_crc == client_crc) {
             std::string msg = "File already exists in local environment";
             dfs_log(LL_SYSINFO) << msg << " for: " << file_name;
 
-            struct stat st;
-            stat(file_path.c_str(), &st);
             long s_mdf_time = static_cast<long> (st.st_mtim.tv_sec);
 
             if (s_mdf_time < mdf_time) {
@@ -425,93 +1349,126 @@ public:
                 new_times.actime = st.st_atime;
                 new_times.modtime = mdf_time;   
                 utime(file_path.c_str(), &new_times);
+                this->checksum_cache.Put(file_path, server_crc);
+                this->metadata_index.Update(file_name, server_crc);
             }
 
-            file_mutex_map_mutex.lock();
-            file_client_map.erase(file_name); 
-            file_mutex_map_mutex.unlock();
+            this->locks.ReleaseWrite(file_name, client_id);
             return Status(StatusCode::ALREADY_EXISTS, msg);
         }
 
-        /* 4. Send file data */
-        std::ifstream ifs;
-        FileData file_data;
-        char buffer[BUFSIZE];
-        size_t bytes_sent = 0, total_sent = 0;
-        size_t file_size = st.st_size;
-        
-        dfs_log(LL_SYSINFO) << "Server starts sending data for file: " << file_name;
-        
-        while (total_sent < file_size) {
-            if (context->IsCancelled()) {
-                const std::string &error_msg = "Deadline exceeded or Client cancelled, abandoning";
-                dfs_log(LL_ERROR) << error_msg;
-                return Status(StatusCode::DEADLINE_EXCEEDED, error_msg);
-            }
+        /* 4. Open the file for sending */
+        *read_file = DFSReadFile::Open(file_path);
+        if (!*read_file) {
+            dfs_log(LL_ERROR) << "Server failed to open " << file_path;
+            return Status(StatusCode::UNAVAILABLE, "Server failed to open file");
+        }
+        return Status::OK;
+    }
 
-            if ((file_size - total_sent) >= (BUFSIZE - 1)) {
-                bytes_sent = BUFSIZE - 1;
-            }
-            else {
-                bytes_sent = file_size - total_sent;
-            }
+    /**
+     * Serve a bulk transfer call
+     *
+     * Runs on its own thread for the lifetime of the call.
+     *
+     * @param call
+     */
+    void ProcessBulkCall(DFSBulkServerCall *call) {
+        grpc::ByteBuffer buffer;
+        RequestFile request_file;
+        if (!call->Read(&buffer) || !dfs_bulk_parse(&buffer, &request_file)) {
+            dfs_log(LL_ERROR) << "Server failed to parse bulk request";
+            call->Finish(Status(StatusCode::INVALID_ARGUMENT, "Malformed bulk request"));
+            return;
+        }
 
-            if (ifs.good() && ifs.is_open()) {
-                ifs.read(buffer, bytes_sent);
-                file_data.set_data(buffer, bytes_sent);
-                server_writer->Write(file_data);
-                total_sent += bytes_sent;
+        if (call->context.method() == DFS_BULK_FETCH_METHOD) {
+            call->Finish(this->BulkFetchFile(call, request_file));
+        }
+        else if (call->context.method() == DFS_BULK_STORE_METHOD) {
+            FileInfo file_info;
+            Status status = this->ReceiveFile(NULL, request_file, [&](size_t resume_offset) {
+                call->context.AddInitialMetadata(DFS_CHUNK_SIZE_KEY, std::to_string(DFS_MAX_CHUNK_SIZE));
+                call->context.AddInitialMetadata(DFS_RESUME_OFFSET_KEY, std::to_string(resume_offset));
+                call->SendInitialMetadata();
+            }, [&](const ChunkWriter &write_chunk) {
+                if (!call->Read(&buffer)) {
+                    return false;
+                }
+                std::vector<grpc::Slice> slices;
+                buffer.Dump(&slices);
+                for (const grpc::Slice &slice : slices) {
+                    if (!write_chunk(reinterpret_cast<const char *>(slice.begin()), slice.size())) {
+                        return false;
+                    }
+                }
+                return true;
+            }, &file_info);
+            if (status.ok()) {
+                call->Write(dfs_bulk_serialize(file_info));
             }
+            call->Finish(status);
+        }
+        else {
+            call->Finish(Status(StatusCode::UNIMPLEMENTED, "Unknown bulk method " + call->context.method()));
+        }
+    }
+
+    /**
+     * Send a file over a bulk call as raw slices read from it
+     *
+     * @param call
+     * @param request_file
+     * @return Status
+     */
+    Status BulkFetchFile(DFSBulkServerCall *call, const RequestFile &request_file) {
+        std::shared_ptr<DFSReadFile> read_file;
+        Status status = this->PrepareFetch(request_file, &read_file);
+        if (!status.ok()) {
+            return status;
         }
-        ifs.close();
 
-        if (total_sent != file_size) {
-            dfs_log(LL_ERROR) << "Server failed to send complete data";
-            return Status(StatusCode::INTERNAL, "Server failed to send complete data");
+        DFSChunkSizer chunk_sizer(dfs_peer_chunk_limit(call->context.client_metadata()));
+        auto start_time = std::chrono::steady_clock::now();
+        size_t offset = 0;
+        std::uint32_t crc = 0;
+        dfs_log(LL_SYSINFO) << "Server starts sending bulk data for file: " << request_file.name();
+
+        while (offset < read_file->Size()) {
+            size_t chunk_length = std::min(chunk_sizer.ChunkSize(), read_file->Size() - offset);
+            grpc::Slice slice;
+            if (read_file->Changed() || !dfs_read_slice(*read_file, offset, chunk_length, &slice)) {
+                dfs_log(LL_ERROR) << "File changed during transfer: " << request_file.name();
+                return Status(StatusCode::ABORTED, "File changed during transfer");
+            }
+            crc = dfs_crc32c(reinterpret_cast<const char *>(slice.begin()), chunk_length, crc);
+            auto write_start = std::chrono::steady_clock::now();
+            if (!call->Write(grpc::ByteBuffer(&slice, 1))) {
+                dfs_log(LL_ERROR) << "Deadline exceeded or Client cancelled, abandoning";
+                return Status(StatusCode::CANCELLED, "Deadline exceeded or Client cancelled, abandoning");
+            }
+            chunk_sizer.Record(chunk_length, std::chrono::steady_clock::now() - write_start);
+            offset += chunk_length;
         }
 
-        dfs_log(LL_SYSINFO) << "Server successful send file: " << file_name;
+        dfs_log(LL_SYSINFO) << "Server sent " << offset << " bytes of " << request_file.name() << " at "
+                            << dfs_megabytes_per_second(offset, std::chrono::steady_clock::now() - start_time)
+                            << " MB/s, final chunk size " << chunk_sizer.ChunkSize();
+        call->context.AddTrailingMetadata(DFS_RANGE_CRC_KEY, std::to_string(crc));
         return Status::OK;
     }
 
 
     Status ListFiles(ServerContext *context, 
             const Void *void_, FileList *file_list) override {
-        std::lock_guard<std::mutex> lock(dir_mutex);
-        DIR *dir;
-        struct dirent *ent;
-
-        if ((dir = opendir(this->mount_path.c_str())) != NULL) {
-            while ((ent = readdir(dir)) != NULL) {
-                std::string file_name(ent->d_name);
-                std::string file_path = WrapPath(file_name);
-
-                FileInfo *file_info = file_list->add_files();
-                struct stat st;
-                if ((stat(file_path.c_str(), &st)) == -1) {
-                    std::stringstream str_stream;
-                    str_stream << "Server fail to open up: " << file_path;
-                    dfs_log(LL_ERROR) << str_stream.str();
-                    file_info->set_name(file_name);
-                    continue;                    
-                }
-
-                long mdf_time = static_cast<long> (st.st_mtim.tv_sec);
-                long crt_time = static_cast<long> (st.st_ctim.tv_sec);
-                file_info->set_mdf_time(mdf_time); 
-                file_info->set_crt_time(crt_time);
-                file_info->set_name(file_name);
-                file_info->set_file_size(st.st_size);
-                dfs_log(LL_SYSINFO) << "Found file " << file_path;
-            }
-        }
-        else {
-            std::string msg = "Server failed to open directory";
-            dfs_log(LL_ERROR) << msg;
-            return Status(StatusCode::INTERNAL, msg);
+        // Served from the index, which handlers update as they change the mount
+        std::shared_ptr<const DFSDirSnapshot> snapshot = this->metadata_index.Snapshot();
+        for (const auto &entry : snapshot->files) {
+            dfs_set_file_info(entry.first, entry.second, file_list->add_files());
         }
-
-        closedir(dir);
+        file_list->set_version(snapshot->version);
+        file_list->set_full(true);
+        dfs_log(LL_DEBUG) << "Listed " << snapshot->files.size() << " files at index version " << snapshot->version;
         return Status::OK;
     }
 
@@ -523,16 +1480,7 @@ public:
         //int client_crc = request_file->client_file_crc();
         std::string file_path = WrapPath(file_name);
 
-        /* Ensure the file has corresponding lock */
-        file_mutex_map_mutex.lock();
-        if (file_mutex_map.find(file_name) == file_mutex_map.end()) {
-            file_mutex_map[file_name] = std::make_unique<std::mutex>();
-        }
-        auto file_mutex_iter = file_mutex_map.find(file_name);
-        std::mutex *file_mutex = file_mutex_iter->second.get();
-        file_mutex_map_mutex.unlock();
-
-        std::lock_guard<std::mutex> lock(*file_mutex);   
+        std::shared_lock<DFSSharedMutex> lock(this->locks.FileMutex(file_name));
         struct stat st;
         if (stat(file_path.c_str(), &st) == -1) {
             std::stringstream str_stream;
@@ -551,27 +1499,65 @@ public:
     }
 
 
-    Status RequestWriteLock(ServerContext *context, 
-            const RequestFile *request_file, Void *void_) override {
-        std::string file_name = request_file->name();
-        std::string client_id = request_file->request_client_id();
-        
-        std::lock_guard<std::mutex> lock(file_client_map_mutex);
-        auto client_id_lock = file_client_map.find(file_name);
-        if (client_id_lock == file_client_map.end()) { 
-            file_client_map[file_name] = client_id;
+    /**
+     * Take the write lock of a file for the client of a request.
+     *
+     * Serves RequestWriteLock as well as stores and deletes that take the
+     * lock themselves. A refused lock is RESOURCE_EXHAUSTED, which the
+     * client reports as such.
+     *
+     * @param context NULL for bulk transfer calls
+     * @param request_file
+     * @return Status
+     */
+    Status GrantWriteLock(ServerContext *context, const RequestFile &request_file) {
+        std::string file_name = request_file.name();
+        std::string client_id = request_file.request_client_id();
+
+        // Queue for a busy lock if the client asked to, but give up before its deadline
+        std::chrono::milliseconds wait(std::max<long>(request_file.lock_wait_ms(), 0));
+        if (context != NULL) {
+            std::chrono::milliseconds until_deadline = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    context->deadline() - std::chrono::system_clock::now());
+            wait = std::min(wait, until_deadline);
         }
-        else {
+
+        if (!this->locks.AcquireWrite(file_name, client_id, wait)) {
             std::stringstream str_str;
             str_str << "Fail to acquire the lock for client ID: " << client_id;
+            if (wait.count() > 0) {
+                str_str << " after waiting " << wait.count() << " ms";
+            }
             dfs_log(LL_ERROR) << str_str.str();
-            return Status(StatusCode::INTERNAL, str_str.str());
+            dfs_log(LL_DEBUG) << "Write locks: " << this->locks.Stats();
+            return Status(StatusCode::RESOURCE_EXHAUSTED, str_str.str());
+        }
+
+        // Tells the client how often to renew the lock during a long store
+        if (context != NULL) {
+            context->AddInitialMetadata(DFS_LEASE_MS_KEY, std::to_string(this->locks.LeaseMs()));
         }
+        dfs_log(LL_DEBUG) << "Write locks: " << this->locks.Stats();
+        return Status::OK;
+    }
 
-        /* 3. Create file-specific mutex for the client */
-        std::lock_guard<std::mutex> lock1(file_mutex_map_mutex);
-        if (file_mutex_map.find(file_name) == file_mutex_map.end()) {
-            file_mutex_map[file_name] = std::make_unique<std::mutex>();
+
+    Status RequestWriteLock(ServerContext *context, 
+            const RequestFile *request_file, Void *void_) override {
+        return this->GrantWriteLock(context, *request_file);
+    }
+
+
+    Status RenewWriteLock(ServerContext *context,
+            const RequestFile *request_file, Void *void_) override {
+        std::string file_name = request_file->name();
+        std::string client_id = request_file->request_client_id();
+
+        if (!this->locks.RenewWrite(file_name, client_id)) {
+            std::stringstream str_str;
+            str_str << client_id << " has no write lock of " << file_name << " to renew";
+            dfs_log(LL_ERROR) << str_str.str();
+            return Status(StatusCode::FAILED_PRECONDITION, str_str.str());
         }
         return Status::OK;
     }
@@ -579,8 +1565,21 @@ public:
 
     Status CallbackList(ServerContext *context, 
             const RequestFile *request_file, FileList *file_list) override {
-        Void *void_ = NULL;
-        return this->ListFiles(context, void_, file_list);
+        // Only what changed since the client's last listing, unless the journal lost track
+        DFSDirChanges changes = this->metadata_index.Changes(request_file->since_version());
+        dfs_set_changes(changes, file_list);
+        dfs_log(LL_DEBUG) << (changes.full ? "Full" : "Delta") << " callback listing of " << file_list->files_size()
+                          << " files since version " << request_file->since_version() << "; metadata index: "
+                          << this->metadata_index.Stats();
+        return Status::OK;
+    }
+
+
+    grpc::ServerWriteReactor<FileList>* Watch(grpc::CallbackServerContext *context,
+            const RequestFile *request_file) override {
+        dfs_log(LL_SYSINFO) << "Client " << request_file->request_client_id() << " watches from version "
+                            << request_file->since_version() << "; " << this->watch_hub.Stats();
+        return new DFSWatchReactor(&this->metadata_index, &this->watch_hub, request_file->since_version());
     }
 
 
@@ -592,29 +1591,22 @@ public:
         //long client_crc = request_file->client_file_crc();
         std::string file_path = WrapPath(file_name);   
 
-        /* Ensure the file has corresponding write lock */
-        file_mutex_map_mutex.lock();
-        if (file_mutex_map.find(file_name) == file_mutex_map.end()) {
-            file_mutex_map[file_name] = std::make_unique<std::mutex>();
+        /* Check if the file has been owned by a client */
+        if (request_file->take_lock()) {
+            Status lock_status = this->GrantWriteLock(context, *request_file);
+            if (!lock_status.ok()) {
+                return lock_status;
+            }
         }
-        auto file_mutex_iter = file_mutex_map.find(file_name);
-        std::mutex *file_mutex = file_mutex_iter->second.get();
-        file_mutex_map_mutex.unlock();
 
-        /* Check if the file has been owned by a client */
-        file_client_map_mutex.lock();
-        auto file_client_iter = file_client_map.find(file_name);
-        if ((file_client_iter == file_client_map.end()) || ((file_client_iter->second).compare(client_id) != 0)) {
+        if (!this->locks.HoldsWrite(file_name, client_id)) {
             std::stringstream str_str;
             str_str << client_id << " has no write lock for " << file_name << ", or the file has already been locked" << std::endl;
             dfs_log(LL_SYSINFO) << str_str.str();
-            file_client_map_mutex.unlock();
             return Status(StatusCode::INTERNAL, str_str.str());
         }
-        file_client_map_mutex.unlock();
 
-        std::lock_guard<std::mutex> lock3(dir_mutex);
-        std::lock_guard<std::mutex> lock4(*file_mutex);
+        std::lock_guard<DFSSharedMutex> lock(this->locks.FileMutex(file_name));
         
         /* Check if file exists */
         struct stat st;
@@ -623,31 +1615,36 @@ public:
             str_stream << "File not found for " << file_path;
             dfs_log(LL_ERROR) << str_stream.str();
 
-            std::lock_guard<std::mutex> lock(file_client_map_mutex);
-            file_client_map.erase(file_name);
+            this->locks.ReleaseWrite(file_name, client_id);
             return Status(StatusCode::NOT_FOUND, str_stream.str());
         } 
 
-        /* Delete the file */
-        int rv = remove(file_path.c_str());
+        /* Delete the file, unless the lease ran out while waiting for the file's lock */
+        int rv = -1;
+        if (!this->locks.CommitIfHolder(file_name, client_id, [&] { rv = remove(file_path.c_str()); })) {
+            std::string error_msg = "Write lock of " + file_name + " expired before the delete";
+            dfs_log(LL_ERROR) << error_msg;
+            return Status(StatusCode::ABORTED, error_msg);
+        }
         if (rv == -1) {
             std::stringstream str_stream;
             str_stream << "Server fail to delete " << file_path;
             dfs_log(LL_ERROR) << str_stream.str();
 
-            std::lock_guard<std::mutex> lock(file_client_map_mutex);
-            file_client_map.erase(file_name);
+            this->locks.ReleaseWrite(file_name, client_id);
             return Status(StatusCode::INTERNAL, str_stream.str());            
         }
 
         dfs_log(LL_SYSINFO) << "Server sucessfully deleted the file " << file_name;
+        this->chunk_index.RemoveFile(file_name);
+        this->checksum_cache.Invalidate(file_path);
+        this->metadata_index.Remove(file_name);
 
         return_file_info->set_name(file_name);
         long mdf_time_2 = static_cast<long> (st.st_mtim.tv_sec);
         return_file_info->set_mdf_time(mdf_time_2); 
 
-        std::lock_guard<std::mutex> lock5(file_client_map_mutex);
-        file_client_map.erase(file_name);
+        this->locks.ReleaseWrite(file_name, client_id);
         return Status::OK;        
     }
 };
@@ -673,7 +1670,37 @@ DFSServerNode::DFSServerNode(const std::string &server_address,
         server_address(server_address),
         mount_path(mount_path),
         num_async_threads(num_async_threads),
+        sync_writes(false),
+        persist_checksums(false),
+        lease_ms(DFS_LEASE_MS),
         grader_callback(callback) {}
+/**
+ * Set whether stored files are fsync'd before they replace the live file
+ *
+ * @param sync_writes
+ */
+void DFSServerNode::SetSyncWrites(bool sync_writes) {
+    this->sync_writes = sync_writes;
+}
+
+/**
+ * Set whether file checksums are kept in a sidecar in the mount across restarts
+ *
+ * @param persist_checksums
+ */
+void DFSServerNode::SetPersistChecksums(bool persist_checksums) {
+    this->persist_checksums = persist_checksums;
+}
+
+/**
+ * Set how long a write lock lasts before a client must renew it
+ *
+ * @param lease_ms
+ */
+void DFSServerNode::SetLeaseMs(long lease_ms) {
+    this->lease_ms = lease_ms;
+}
+
 /**
  * Server shutdown
  */
@@ -685,7 +1712,8 @@ DFSServerNode::~DFSServerNode() noexcept {
  * Start the DFSServerNode server
  */
 void DFSServerNode::Start() {
-    DFSServiceImpl service(this->mount_path, this->server_address, this->num_async_threads);
+    DFSServiceImpl service(this->mount_path, this->server_address, this->num_async_threads, this->sync_writes,
+                           this->persist_checksums, this->lease_ms);
 
 
     dfs_log(LL_SYSINFO) << "DFSServerNode server listening on " << this->server_address;
@@ -25,6 +25,15 @@ private:
     /** Number of asynchronous threads to use **/
     int num_async_threads;
 
+    /** Whether stored files are fsync'd before they are renamed into place **/
+    bool sync_writes;
+
+    /** Whether file checksums are saved to a sidecar in the mount **/
+    bool persist_checksums;
+
+    /** How long a write lock lasts unless its client renews it **/
+    long lease_ms;
+
     /** Server callback **/
     std::function<void()> grader_callback;
 
@@ -34,6 +43,9 @@ public:
         int num_async_threads,
         std::function<void()> callback);
     ~DFSServerNode();
+    void SetSyncWrites(bool sync_writes);
+    void SetPersistChecksums(bool persist_checksums);
+    void SetLeaseMs(long lease_ms);
     void Shutdown();
     void Start();
 };
@@ -1,7 +1,16 @@
 #include <string>
+#include <vector>
+#include <cstdio>
+#include <chrono>
+#include <cstdlib>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <cstddef>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 #include "dfslib-shared-p2.h"
@@ -23,3 +32,195 @@ dfs_log_level_e DFS_LOG_LEVEL = LL_ERROR;
 // Just be aware they are always submitted, so they should
 // be compilable.
 //
+
+bool dfs_metadata_value(const std::multimap<grpc::string_ref, grpc::string_ref>& metadata,
+                        const std::string &key, std::string *value) {
+    auto iter = metadata.find(key);
+    if (iter == metadata.end()) {
+        return false;
+    }
+    value->assign(iter->second.data(), iter->second.size());
+    return true;
+}
+
+size_t dfs_peer_chunk_limit(const std::multimap<grpc::string_ref, grpc::string_ref>& metadata) {
+    std::string value;
+    if (!dfs_metadata_value(metadata, DFS_CHUNK_SIZE_KEY, &value)) {
+        return DFS_MIN_CHUNK_SIZE;
+    }
+
+    size_t limit = static_cast<size_t>(strtoul(value.c_str(), NULL, 10));
+    return std::max<size_t>(std::min<size_t>(limit, DFS_MAX_CHUNK_SIZE), BUFSIZE - 1);
+}
+
+bool dfs_range_crc_matches(const std::multimap<grpc::string_ref, grpc::string_ref>& trailing_metadata,
+                           std::uint32_t crc) {
+    std::string value;
+    if (!dfs_metadata_value(trailing_metadata, DFS_RANGE_CRC_KEY, &value)) {
+        return true;
+    }
+    return static_cast<std::uint32_t>(strtoul(value.c_str(), NULL, 10)) == crc;
+}
+
+size_t dfs_resume_offset(const std::multimap<grpc::string_ref, grpc::string_ref>& metadata, size_t file_size) {
+    std::string value;
+    if (!dfs_metadata_value(metadata, DFS_RESUME_OFFSET_KEY, &value)) {
+        return 0;
+    }
+    return std::min<size_t>(static_cast<size_t>(strtoull(value.c_str(), NULL, 10)), file_size);
+}
+
+double dfs_megabytes_per_second(size_t bytes, std::chrono::steady_clock::duration elapsed) {
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    return (bytes / (1024.0 * 1024.0)) / std::max(seconds, 1e-6);
+}
+
+std::string dfs_part_name(const std::string &file_name) {
+    return "." + file_name + ".dfs-part";
+}
+
+std::string dfs_resume_name(const std::string &file_name) {
+    return "." + file_name + ".dfs-resume";
+}
+
+DFSResumePoint::DFSResumePoint() : saved_offset(0), offset(0), crc(0) {}
+
+bool DFSResumePoint::Load(const std::string &path) {
+    std::ifstream ifs(path);
+    if (!(ifs >> this->version >> this->offset >> this->crc)) {
+        return false;
+    }
+    this->saved_offset = this->offset;
+    return true;
+}
+
+bool DFSResumePoint::Save(const std::string &path) {
+    this->saved_offset = this->offset;
+
+    // Replace the old resume point in one step, so a crash mid-write leaves one intact
+    std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream ofs(tmp_path, std::ios::trunc);
+        ofs << this->version << " " << this->offset << " " << this->crc << "\n";
+        if (!ofs) {
+            return false;
+        }
+    }
+    return rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+bool DFSResumePoint::Checkpoint(const std::string &path) {
+    if (this->offset - this->saved_offset < DFS_RESUME_INTERVAL) {
+        return true;
+    }
+    return Save(path);
+}
+
+void DFSResumePoint::Advance(const char *data, size_t size) {
+    this->crc = dfs_crc32c(data, size, this->crc);
+    this->offset += size;
+}
+
+bool DFSResumePoint::Matches(const std::string &part_path) const {
+    std::ifstream ifs(part_path, std::ios::binary);
+    std::vector<char> buffer(DFS_MAX_CHUNK_SIZE);
+    std::uint32_t crc = 0;
+    size_t remaining = this->offset;
+
+    while (remaining > 0) {
+        size_t read_size = std::min(remaining, buffer.size());
+        if (!ifs.read(buffer.data(), read_size)) {
+            return false;
+        }
+        crc = dfs_crc32c(buffer.data(), read_size, crc);
+        remaining -= read_size;
+    }
+    return crc == this->crc;
+}
+
+DFSReadFile::DFSReadFile() : fd(-1), size(0) {}
+
+DFSReadFile::~DFSReadFile() {
+    if (this->fd != -1) {
+        close(this->fd);
+    }
+}
+
+std::shared_ptr<DFSReadFile> DFSReadFile::Open(const std::string &path) {
+    std::shared_ptr<DFSReadFile> file(new DFSReadFile());
+
+    file->fd = open(path.c_str(), O_RDONLY);
+    if (file->fd == -1) {
+        dfs_log(LL_ERROR) << "Failed to open " << path << " for reading: " << strerror(errno);
+        return nullptr;
+    }
+
+    if (fstat(file->fd, &file->snapshot) != 0) {
+        return nullptr;
+    }
+    file->size = file->snapshot.st_size;
+    posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return file;
+}
+
+bool DFSReadFile::Read(size_t offset, size_t length, char *data) const {
+    while (length > 0) {
+        ssize_t read_size = pread(this->fd, data, length, offset);
+        if (read_size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_size <= 0) {
+            return false;
+        }
+        data += read_size;
+        offset += read_size;
+        length -= read_size;
+    }
+    return true;
+}
+
+bool DFSReadFile::Changed() const {
+    struct stat st;
+    if (fstat(this->fd, &st) != 0) {
+        return true;
+    }
+    return st.st_size != this->snapshot.st_size ||
+           st.st_mtim.tv_sec != this->snapshot.st_mtim.tv_sec ||
+           st.st_mtim.tv_nsec != this->snapshot.st_mtim.tv_nsec;
+}
+
+std::string DFSReadFile::Version() const {
+    std::stringstream version;
+    version << this->snapshot.st_ino << ":" << this->snapshot.st_size << ":" << this->snapshot.st_mtim.tv_sec
+            << "." << this->snapshot.st_mtim.tv_nsec;
+    return version.str();
+}
+
+bool dfs_read_slice(const DFSReadFile &file, size_t offset, size_t length, grpc::Slice *slice) {
+    grpc_slice buffer = grpc_slice_malloc(length);
+    if (!file.Read(offset, length, reinterpret_cast<char *>(GRPC_SLICE_START_PTR(buffer)))) {
+        grpc_slice_unref(buffer);
+        return false;
+    }
+    *slice = grpc::Slice(buffer, grpc::Slice::STEAL_REF);
+    return true;
+}
+
+grpc::ByteBuffer dfs_file_data_chunk(const grpc::Slice &payload) {
+    // FileData wire format: field 5 as length-delimited, then a varint length
+    unsigned char header[16];
+    size_t header_length = 0;
+    header[header_length++] = (5 << 3) | 2;
+    size_t value = payload.size();
+    while (value >= 0x80) {
+        header[header_length++] = static_cast<unsigned char>(value | 0x80);
+        value >>= 7;
+    }
+    header[header_length++] = static_cast<unsigned char>(value);
+
+    grpc::Slice slices[2] = {
+        grpc::Slice(header, header_length),
+        payload
+    };
+    return grpc::ByteBuffer(slices, 2);
+}
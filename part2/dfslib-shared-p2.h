@@ -10,9 +10,15 @@
 #include <fstream>
 #include <string>
 #include <thread>
+#include <chrono>
+#include <map>
+#include <memory>
 #include <sys/stat.h>
+#include <grpcpp/grpcpp.h>
 
 #include "src/dfs-utils.h"
+#include "../shared/dfs-chunk-sizer.h"
+#include "dfslib-crc-p2.h"
 #include "proto-src/dfs-service.grpc.pb.h"
 
 
@@ -58,5 +64,265 @@ struct EventStruct {
 
 #define BUFSIZE 4096
 
+/** Largest chunk the adaptive streamer sends (4 MB) **/
+#define DFS_MAX_CHUNK_SIZE (4 * 1024 * 1024)
+
+/** Max gRPC message size set on both ends, leaves room for the FileData framing **/
+#define DFS_MAX_MESSAGE_SIZE (DFS_MAX_CHUNK_SIZE + 64 * 1024)
+
+/** Metadata key a receiver uses to advertise the largest chunk it accepts **/
+#define DFS_CHUNK_SIZE_KEY "dfs-max-chunk-size"
+
+/** Default stripe size for ranged multi-stream transfers (8 MB) **/
+#define DFS_STRIPE_SIZE (8 * 1024 * 1024)
+
+/** Most concurrent streams a single striped transfer may use **/
+#define DFS_MAX_TRANSFER_STREAMS 16
+
+/** Metadata key the server uses to report the full size of a fetched file **/
+#define DFS_FILE_SIZE_KEY "dfs-file-size"
+
+/** Metadata key the server uses to report the version of a fetched file **/
+#define DFS_FILE_VERSION_KEY "dfs-file-version"
+
+/** Metadata key the server uses to tell a client where to resume a store **/
+#define DFS_RESUME_OFFSET_KEY "dfs-resume-offset"
+
+/** Trailing metadata key carrying the CRC-32C of the bytes a fetch sent **/
+#define DFS_RANGE_CRC_KEY "dfs-range-crc"
+
+/** Metadata key the server uses to tell a client how long its write lock lasts **/
+#define DFS_LEASE_MS_KEY "dfs-lease-ms"
+
+/** Bytes received between two saved resume points **/
+#define DFS_RESUME_INTERVAL (1024 * 1024)
+
+/** Longest a callback listing is held back while nothing changes **/
+#define DFS_CALLBACK_HEARTBEAT_MS 30000
+
+/**
+ * Look up a metadata value sent by the peer
+ *
+ * @param metadata
+ * @param key
+ * @param value set when the key is present
+ * @return bool
+ */
+bool dfs_metadata_value(const std::multimap<grpc::string_ref, grpc::string_ref>& metadata,
+                        const std::string& key, std::string* value);
+
+/**
+ * Read the chunk limit a peer advertised under DFS_CHUNK_SIZE_KEY,
+ * clamped to what this side supports.
+ *
+ * @param metadata
+ * @return size_t
+ */
+size_t dfs_peer_chunk_limit(const std::multimap<grpc::string_ref, grpc::string_ref>& metadata);
+
+/**
+ * Check the CRC of the bytes a fetch received against the one the server
+ * computed while sending them
+ *
+ * @param trailing_metadata
+ * @param crc
+ * @return bool true if they match or the server sent none
+ */
+bool dfs_range_crc_matches(const std::multimap<grpc::string_ref, grpc::string_ref>& trailing_metadata,
+                           std::uint32_t crc);
+
+/**
+ * Read the offset a server wants a store resumed from, clamped to the
+ * size of the file being sent.
+ *
+ * @param metadata
+ * @param file_size
+ * @return size_t 0 if the server did not send one
+ */
+size_t dfs_resume_offset(const std::multimap<grpc::string_ref, grpc::string_ref>& metadata, size_t file_size);
+
+/**
+ * Throughput in MB/s for logging transfer summaries
+ *
+ * @param bytes
+ * @param elapsed
+ * @return double
+ */
+double dfs_megabytes_per_second(size_t bytes, std::chrono::steady_clock::duration elapsed);
+
+/**
+ * Name of the hidden file a transfer is received into before it
+ * replaces the real file
+ *
+ * @param file_name
+ * @return std::string
+ */
+std::string dfs_part_name(const std::string& file_name);
+
+/**
+ * Name of the hidden file holding the resume point of a partial transfer
+ *
+ * @param file_name
+ * @return std::string
+ */
+std::string dfs_resume_name(const std::string& file_name);
+
+/**
+ * How far a partial file got, persisted next to it so an interrupted
+ * transfer only has to send the missing bytes.
+ *
+ * The CRC of the received prefix is kept with the offset, so a partial
+ * file that was changed or cut short on disk is not resumed.
+ */
+class DFSResumePoint {
+
+private:
+    /** Offset of the last saved resume point **/
+    size_t saved_offset;
+
+public:
+    /** The source the partial file was received from **/
+    std::string version;
+
+    /** Bytes received so far **/
+    size_t offset;
+
+    /** CRC of the bytes [0, offset) **/
+    std::uint32_t crc;
+
+    DFSResumePoint();
+
+    /**
+     * Load a resume point, returns false if there is none
+     *
+     * @param path
+     * @return bool
+     */
+    bool Load(const std::string& path);
+
+    /**
+     * Persist the resume point
+     *
+     * @param path
+     * @return bool
+     */
+    bool Save(const std::string& path);
+
+    /**
+     * Persist the resume point once DFS_RESUME_INTERVAL bytes arrived since
+     * it was last saved, so small messages don't each cost a file write
+     *
+     * @param path
+     * @return bool false if saving failed
+     */
+    bool Checkpoint(const std::string& path);
+
+    /**
+     * Add received bytes to the resume point
+     *
+     * @param data
+     * @param size
+     */
+    void Advance(const char* data, size_t size);
+
+    /**
+     * Indicates if the partial file still holds the bytes the resume point describes
+     *
+     * @param part_path
+     * @return bool
+     */
+    bool Matches(const std::string& part_path) const;
+};
+
+/**
+ * A file opened for reading, along with the stat taken when it was opened.
+ *
+ * Reads go through pread into memory the caller owns; the file is never
+ * mapped. A writer outside the server can truncate a file in the mount
+ * at any time, which makes touching the lost pages of a mapping raise
+ * SIGBUS on whichever thread gets there, gRPC's included. With pread the
+ * truncation only shortens a read, and the transfer using it fails.
+ *
+ * Stores rename a new file into place rather than rewriting the old
+ * one, so the descriptor keeps reading the version it opened.
+ */
+class DFSReadFile {
+
+private:
+    /** The open file descriptor **/
+    int fd;
+
+    /** Size of the file when it was opened **/
+    size_t size;
+
+    /** The stat taken when the file was opened **/
+    struct stat snapshot;
+
+    DFSReadFile();
+
+public:
+    ~DFSReadFile();
+
+    DFSReadFile(const DFSReadFile&) = delete;
+    DFSReadFile& operator=(const DFSReadFile&) = delete;
+
+    /**
+     * Open a file for reading. Returns NULL if the file cannot be opened.
+     *
+     * @param path
+     * @return std::shared_ptr<DFSReadFile>
+     */
+    static std::shared_ptr<DFSReadFile> Open(const std::string& path);
+
+    size_t Size() const { return this->size; }
+
+    /**
+     * Read exactly `length` bytes starting at `offset`
+     *
+     * @param offset
+     * @param length
+     * @param data
+     * @return bool false on an error, or if the file got shorter since it was opened
+     */
+    bool Read(size_t offset, size_t length, char* data) const;
+
+    /**
+     * Indicates if the file changed size or mtime since it was opened,
+     * e.g. from a writer outside the server that rewrites it in place.
+     *
+     * @return bool
+     */
+    bool Changed() const;
+
+    /**
+     * The inode, size and mtime of the file when it was opened, so the
+     * stripes of a ranged fetch can check they read the same file
+     *
+     * @return std::string
+     */
+    std::string Version() const;
+};
+
+/**
+ * Read a range of a file into a slice that gRPC takes over, so the bytes
+ * stay valid for as long as gRPC holds on to them
+ *
+ * @param file
+ * @param offset
+ * @param length
+ * @param slice
+ * @return bool false if the range could not be read
+ */
+bool dfs_read_slice(const DFSReadFile& file, size_t offset, size_t length, grpc::Slice* slice);
+
+/**
+ * Build a serialized FileData message around a payload slice, so the
+ * bytes are not copied into a protobuf string first
+ *
+ * @param payload
+ * @return grpc::ByteBuffer
+ */
+grpc::ByteBuffer dfs_file_data_chunk(const grpc::Slice& payload);
+
 #endif
 
@@ -0,0 +1,121 @@
+#include <map>
+#include <list>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <sstream>
+#include <utility>
+#include <algorithm>
+
+#include "dfslib-shared-p2.h"
+#include "dfslib-sync-p2.h"
+
+DFSSyncPool::DFSSyncPool() :
+    running(0), stopping(false), submitted(0), completed(0), serialized(0), aged(0), max_running(0) {}
+
+DFSSyncPool::~DFSSyncPool() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->work_cv.notify_all();
+    for (std::thread &worker : this->workers) {
+        worker.join();
+    }
+}
+
+void DFSSyncPool::Start(int worker_count) {
+    for (int i = 0; i < std::max(worker_count, 1); i++) {
+        this->workers.emplace_back(&DFSSyncPool::Run, this);
+    }
+}
+
+void DFSSyncPool::Submit(const std::string &file_name, size_t size, const Task &task) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->submitted++;
+        Job job = {file_name, size, Clock::now(), task};
+        if (this->busy.count(file_name) > 0) {
+            this->held[file_name].push_back(std::move(job));
+            this->serialized++;
+            return;
+        }
+        this->busy.insert(file_name);
+        this->ready.push_back(std::move(job));
+    }
+    this->work_cv.notify_one();
+}
+
+DFSSyncPool::Job DFSSyncPool::TakeLocked() {
+    Clock::time_point now = Clock::now();
+    auto smallest = this->ready.begin();
+    auto oldest = this->ready.begin();
+    for (auto job = this->ready.begin(); job != this->ready.end(); ++job) {
+        if (job->size < smallest->size) {
+            smallest = job;
+        }
+        if (job->queued < oldest->queued) {
+            oldest = job;
+        }
+    }
+
+    auto next = smallest;
+    if (oldest != smallest && now - oldest->queued >= std::chrono::milliseconds(DFS_SYNC_AGING_MS)) {
+        next = oldest;
+        this->aged++;
+    }
+    Job job = std::move(*next);
+    this->ready.erase(next);
+    return job;
+}
+
+void DFSSyncPool::Run() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (true) {
+        this->work_cv.wait(lock, [this] { return this->stopping || !this->ready.empty(); });
+        if (this->stopping) {
+            return;
+        }
+
+        Job job = TakeLocked();
+        this->running++;
+        this->max_running = std::max(this->max_running, this->running);
+        lock.unlock();
+
+        job.task();
+
+        lock.lock();
+        this->running--;
+        this->completed++;
+
+        // The next job of the same file may go now
+        auto held_iter = this->held.find(job.file_name);
+        if (held_iter == this->held.end()) {
+            this->busy.erase(job.file_name);
+        }
+        else {
+            this->ready.push_back(std::move(held_iter->second.front()));
+            held_iter->second.pop_front();
+            if (held_iter->second.empty()) {
+                this->held.erase(held_iter);
+            }
+            this->work_cv.notify_one();
+        }
+
+        if (this->running == 0 && this->ready.empty()) {
+            lock.unlock();
+            dfs_log(LL_DEBUG) << "Sync pool idle: " << Stats();
+            lock.lock();
+        }
+    }
+}
+
+std::string DFSSyncPool::Stats() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    std::stringstream stats;
+    stats << this->completed << " of " << this->submitted << " operations done on " << this->workers.size()
+          << " workers (at most " << this->max_running << " at once), " << this->serialized
+          << " waited for their file, " << this->aged << " went ahead of smaller files";
+    return stats.str();
+}
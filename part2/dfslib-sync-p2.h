@@ -0,0 +1,120 @@
+#ifndef PR4_DFSLIB_SYNC_H
+#define PR4_DFSLIB_SYNC_H
+
+#include <map>
+#include <set>
+#include <list>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <condition_variable>
+
+/** Sync operations a mounted client runs at once, unless set otherwise **/
+#define DFS_SYNC_WORKERS 4
+
+/** How long an operation waits before it goes ahead of smaller files **/
+#define DFS_SYNC_AGING_MS 1000
+
+/**
+ * Runs the fetches, stores and deletes of a mounted client on a fixed
+ * number of worker threads.
+ *
+ * Operations on one file run one at a time, in the order they were
+ * submitted; operations on different files run side by side, so one slow
+ * upload holds up only its own file. Of the files ready to go, the
+ * smallest goes first, so a burst of small files is not stuck behind a
+ * large one; an operation that has waited DFS_SYNC_AGING_MS goes first
+ * regardless, so a steady stream of small files can't starve a large one.
+ */
+class DFSSyncPool {
+
+public:
+    typedef std::function<void()> Task;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Job {
+        std::string file_name;
+
+        /** Bytes the operation moves, as far as known when it was submitted **/
+        size_t size;
+
+        Clock::time_point queued;
+        Task task;
+    };
+
+    std::mutex mutex;
+    std::condition_variable work_cv;
+
+    /** Jobs whose file has nothing else queued or running, in submission order **/
+    std::list<Job> ready;
+
+    /** Jobs waiting behind an earlier one for the same file **/
+    std::map<std::string, std::deque<Job>> held;
+
+    /** Files with a job ready or running **/
+    std::set<std::string> busy;
+
+    size_t running;
+
+    bool stopping;
+
+    std::vector<std::thread> workers;
+
+    size_t submitted;
+    size_t completed;
+
+    /** Jobs that had to wait for an earlier job on the same file **/
+    size_t serialized;
+
+    /** Jobs that went ahead of smaller files because they waited too long **/
+    size_t aged;
+
+    size_t max_running;
+
+    /**
+     * Take the next job to run; the mutex must be held and `ready` not empty
+     *
+     * @return Job
+     */
+    Job TakeLocked();
+
+    void Run();
+
+public:
+    DFSSyncPool();
+
+    ~DFSSyncPool();
+
+    /**
+     * Start the worker threads
+     *
+     * @param worker_count
+     */
+    void Start(int worker_count);
+
+    /**
+     * Queue an operation on a file
+     *
+     * @param file_name
+     * @param size bytes the operation moves, to put small files first
+     * @param task
+     */
+    void Submit(const std::string& file_name, size_t size, const Task& task);
+
+    /**
+     * One-line summary of the operations run, for logging
+     *
+     * @return std::string
+     */
+    std::string Stats();
+};
+
+#endif
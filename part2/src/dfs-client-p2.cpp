@@ -61,7 +61,9 @@ void DFSClient::ProcessCommand(const std::string &command, const std::string &fi
 }
 
 void DFSClient::InitializeClientNode(const std::string &server_address) {
-    this->client_node.CreateStub(grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials()));
+    grpc::ChannelArguments channel_args;
+    channel_args.SetMaxReceiveMessageSize(DFS_MAX_MESSAGE_SIZE);
+    this->client_node.CreateStub(grpc::CreateCustomChannel(server_address, grpc::InsecureChannelCredentials(), channel_args));
 }
 
 void DFSClient::SetMountPath(const std::string &path) {
@@ -74,6 +76,30 @@ void DFSClient::SetDeadlineTimeout(int deadline) {
     this->client_node.SetDeadlineTimeout(deadline);
 }
 
+void DFSClient::SetBulkTransfer(bool enabled) {
+    this->client_node.SetBulkTransfer(enabled);
+}
+
+void DFSClient::SetDeltaSync(bool enabled) {
+    this->client_node.SetDeltaSync(enabled);
+}
+
+void DFSClient::SetTransferStreams(int streams, size_t stripe_size) {
+    this->client_node.SetTransferStreams(streams, stripe_size);
+}
+
+void DFSClient::SetLockWait(int lock_wait) {
+    this->client_node.SetLockWait(lock_wait);
+}
+
+void DFSClient::SetOneStepLock(bool enabled) {
+    this->client_node.SetOneStepLock(enabled);
+}
+
+void DFSClient::SetSyncWorkers(int workers) {
+    this->client_node.SetSyncWorkers(workers);
+}
+
 void DFSClient::Mount(const std::string &filepath) {
 
     this->mount_path = filepath;
@@ -85,7 +111,7 @@ void DFSClient::Mount(const std::string &filepath) {
 
     std::vector <std::thread> threads;
     //    uint event_flags = IN_CLOSE_WRITE | IN_OPEN;
-    uint event_flags = IN_CREATE | IN_MODIFY | IN_DELETE;
+    uint event_flags = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE;
 
     const FileDescriptor fd = inotify_init();
 
@@ -96,17 +122,17 @@ void DFSClient::Mount(const std::string &filepath) {
 
     const WatchDescriptor wd = inotify_add_watch(fd, filepath.c_str(), event_flags | IN_ONLYDIR);
 
+    // Syncs each file on the worker pool once its events settle
+    this->client_node.StartSync();
     std::thread thread_watcher(DFSClient::InotifyWatcher, DFSClient::InotifyEventCallback, event_flags, fd, &this->client_node);
     NotifyStruct n_event = {fd, wd, event_flags, &thread_watcher, DFSClient::InotifyEventCallback};
     events.emplace_back(n_event);
     threads.push_back(std::move(thread_watcher));
 
+    // Watches the server, or initializes the callback list if it can't be watched
     thread_async = std::thread(&DFSClientNodeP2::HandleCallbackList, &this->client_node);
     threads.push_back(std::move(thread_async));
 
-    // Initialize the callback list
-    this->client_node.InitCallbackList();
-
     for (std::thread &t : threads) {
         if (t.joinable()) { t.join(); }
     }
@@ -203,26 +229,12 @@ void DFSClient::InotifyEventCallback(uint event_type, const std::string &filenam
     auto event_data = reinterpret_cast<EventStruct *>(data);
     inotify_event *event = reinterpret_cast<inotify_event *>(event_data->event);
     DFSClientNode *node = reinterpret_cast<DFSClientNode *>(event_data->instance);
+    node->InvalidateChecksum(basename);
 
-    // Handle a new file that was created by storing
-    // this file on the server
-    if (event->mask & IN_CREATE) {
-        dfs_log(LL_DEBUG2) << "inotify IN_CREATE event occurred";
-        node->Store(basename);
-    }
-
-    // Handle a new file that was modified by storing
-    // this file on the server
-    if (event->mask & IN_MODIFY) {
-        dfs_log(LL_DEBUG2) << "inotify IN_MODIFY event occurred";
-        node->Store(basename);
-    }
-
-    // Handle a deleted file
-    if (event->mask & IN_DELETE) {
-        dfs_log(LL_DEBUG2) << "inotify IN_DELETE event occurred";
-        node->Delete(basename);
-    }
+    // Creates, modifies and deletes are held back and collapsed into one
+    // store or delete per file once the file settles
+    dfs_log(LL_DEBUG2) << "inotify event " << std::hex << event->mask << std::dec << " occurred for " << basename;
+    node->QueueFileEvent(basename, event->mask);
 
 }
 
@@ -238,9 +250,16 @@ void Usage() {
     std::cout <<
         "\nUSAGE: dfs-client [OPTIONS] COMMAND [FILENAME]\n"
         "-a, --address <address>:  The server address to connect to (default: 0.0.0.0:42001)\n"
+        "-b, --bulk:               Send file bodies as raw bulk transfers (default: off)\n"
         "-d, --debug_level <level>:  The debug level to use: 0, 1, 2, 3 (default: 0 = no debug, higher numbers increase verbosity)\n"
+        "-D, --delta:              Store files of 1 MB or more as rsync-style deltas instead of chunks (default: off)\n"
+        "-j, --sync_workers <int>: Fetches, stores and deletes run at once while mounted (default: 4)\n"
         "-m, --mount_path <path>:  The mount path this client attaches to\n"
+        "-o, --one_step:           Lock with the store or delete call itself, the server must support it (default: off)\n"
+        "-s, --streams <int>:      Concurrent streams used for files larger than one stripe (default: 1)\n"
         "-t, --deadline_timeout <int>:  The deadline timeout in milliseconds (default: 10000)\n"
+        "-w, --lock_wait <ms>:     Wait in line this long for a write lock another client holds (default: 0)\n"
+        "-z, --stripe_size <bytes>:  Stripe size for multi-stream transfers (default: 8388608)\n"
         "-h, --help:               Show help\n"
         "\n"
         "COMMAND is one of mount|fetch|store|delete|list|stat.\n"
@@ -250,19 +269,33 @@ void Usage() {
 
 int main(int argc, char** argv) {
 
-    const char* const short_opts = "a:d:m:r:t:h";
+    const char* const short_opts = "a:bd:Dj:m:or:s:t:w:z:h";
 
     const option long_opts[] = {
         {"address", optional_argument, nullptr, 'a'},
+        {"bulk", no_argument, nullptr, 'b'},
         {"debug_level", optional_argument, nullptr, 'd'},
+        {"delta", no_argument, nullptr, 'D'},
+        {"sync_workers", optional_argument, nullptr, 'j'},
         {"mount_path", optional_argument, nullptr, 'm'},
+        {"one_step", no_argument, nullptr, 'o'},
+        {"streams", optional_argument, nullptr, 's'},
         {"deadline_timeout", optional_argument, nullptr, 't'},
+        {"lock_wait", optional_argument, nullptr, 'w'},
+        {"stripe_size", optional_argument, nullptr, 'z'},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, no_argument, nullptr, 0}
     };
 
     char option_char;
     int deadline_timeout = 10000;
+    bool bulk_transfer = false;
+    bool delta_sync = false;
+    bool one_step_lock = false;
+    int transfer_streams = 1;
+    int lock_wait = 0;
+    int sync_workers = DFS_SYNC_WORKERS;
+    size_t stripe_size = DFS_STRIPE_SIZE;
     int debug_level = static_cast<int>(LL_ERROR);
     std::string command = "";
     std::string filename = "";
@@ -281,15 +314,36 @@ int main(int argc, char** argv) {
             case 'a':
                 server_address = std::string(optarg);
                 break;
+            case 'b':
+                bulk_transfer = true;
+                break;
             case 'd':
                 debug_level = std::stoi(optarg);
                 break;
+            case 'D':
+                delta_sync = true;
+                break;
+            case 'j':
+                sync_workers = std::stoi(optarg);
+                break;
             case 'm':
                 mount_path = std::string(optarg);
                 break;
+            case 'o':
+                one_step_lock = true;
+                break;
+            case 's':
+                transfer_streams = std::stoi(optarg);
+                break;
             case 't':
                 deadline_timeout = std::stoi(optarg);
                 break;
+            case 'w':
+                lock_wait = std::stoi(optarg);
+                break;
+            case 'z':
+                stripe_size = std::stoul(optarg);
+                break;
             case 'h':
                 Usage();
                 break;
@@ -354,6 +408,12 @@ int main(int argc, char** argv) {
 
     client.SetMountPath(mount_path);
     client.SetDeadlineTimeout(deadline_timeout);
+    client.SetBulkTransfer(bulk_transfer);
+    client.SetDeltaSync(delta_sync);
+    client.SetTransferStreams(transfer_streams, stripe_size);
+    client.SetLockWait(lock_wait);
+    client.SetOneStepLock(one_step_lock);
+    client.SetSyncWorkers(sync_workers);
     client.InitializeClientNode(server_address);
     client.ProcessCommand(command, filename);
 
@@ -65,6 +65,49 @@ class DFSClient {
          */
         void SetDeadlineTimeout(int deadline);
 
+        /**
+         * Sends file bodies as raw bulk transfer calls
+         *
+         * @param enabled
+         */
+        void SetBulkTransfer(bool enabled);
+
+        /**
+         * Stores large files as rsync-style deltas instead of content-defined chunks
+         *
+         * @param enabled
+         */
+        void SetDeltaSync(bool enabled);
+
+        /**
+         * Sets the number of concurrent streams and the stripe size for large transfers
+         *
+         * @param streams
+         * @param stripe_size
+         */
+        void SetTransferStreams(int streams, size_t stripe_size);
+
+        /**
+         * Sets how long a store or delete waits in line for a busy write lock
+         *
+         * @param lock_wait
+         */
+        void SetLockWait(int lock_wait);
+
+        /**
+         * Takes write locks with the store or delete call instead of a separate request
+         *
+         * @param enabled
+         */
+        void SetOneStepLock(bool enabled);
+
+        /**
+         * Sets how many fetches, stores and deletes run at once while mounted
+         *
+         * @param workers
+         */
+        void SetSyncWorkers(int workers);
+
         /**
          * Mounts the client to the specified file path.
          *
@@ -6,6 +6,7 @@
 
 #include "dfs-utils.h"
 #include "../dfslib-servernode-p2.h"
+#include "../dfslib-locks-p2.h"
 
 void HandleSignal(int signum) {
     exit(0);
@@ -15,7 +16,10 @@ void Usage() {
     std::cout <<
         "\nUSAGE: dfs-server-p2 [OPTIONS]\n"
         "-a, --address <address>:       The server address to connect to (default: 0.0.0.0:42001)\n"
+        "-c, --checksum_cache:          Keep file checksums in a sidecar in the mount across restarts (default: off)\n"
         "-d, --debug_level <level>:  The debug level to use: 0, 1, 2, 3 (default: 0 = no debug, higher numbers increase verbosity)\n"
+        "-f, --fsync:                   Flush stored files to disk before they replace the old version (default: off)\n"
+        "-l, --lease_ms <ms>:           How long a write lock lasts unless the client renews it (default: 10000)\n"
         "-m, --mount_path <path>:       The mount storage path (default: mnt/server)\n"
         "-n, --num_async_threads <num>: The number of asynchronous threads to generate (default: 4)\n"
         "-h, --help:                    Show help\n\n";
@@ -24,11 +28,14 @@ void Usage() {
 
 int main(int argc, char** argv) {
 
-    const char* const short_opts = "a:d:m:n:h";
+    const char* const short_opts = "a:cd:fl:m:n:h";
 
     const option long_opts[] = {
         {"address", optional_argument, nullptr, 'a'},
+        {"checksum_cache", no_argument, nullptr, 'c'},
         {"debug_level", optional_argument, nullptr, 'd'},
+        {"fsync", no_argument, nullptr, 'f'},
+        {"lease_ms", optional_argument, nullptr, 'l'},
         {"mount_path", optional_argument, nullptr, 'm'},
         {"num_async_threads", optional_argument, nullptr, 'n'},
         {"help", no_argument, nullptr, 'h'},
@@ -38,6 +45,9 @@ int main(int argc, char** argv) {
     char option_char;
     int debug_level = static_cast<int>(LL_ERROR);
     long num_async_threads = 4;
+    bool sync_writes = false;
+    bool persist_checksums = false;
+    long lease_ms = DFS_LEASE_MS;
     std::string mount_path = "mnt/server/";
     std::string server_address = "0.0.0.0:42001";
 
@@ -46,9 +56,18 @@ int main(int argc, char** argv) {
             case 'a':
                 server_address = std::string(optarg);
                 break;
+            case 'c':
+                persist_checksums = true;
+                break;
             case 'd':
                 debug_level = std::stoi(optarg);
                 break;
+            case 'f':
+                sync_writes = true;
+                break;
+            case 'l':
+                lease_ms = std::stol(optarg);
+                break;
             case 'm':
                 mount_path = std::string(optarg);
                 break;
@@ -71,6 +90,9 @@ int main(int argc, char** argv) {
     signal(SIGTERM, HandleSignal);
 
     DFSServerNode server_node(server_address, dfs_clean_path(mount_path), num_async_threads, [&]{ return; });
+    server_node.SetSyncWrites(sync_writes);
+    server_node.SetPersistChecksums(persist_checksums);
+    server_node.SetLeaseMs(lease_ms);
     server_node.Start();
 
     return 0;
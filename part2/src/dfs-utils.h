@@ -6,11 +6,6 @@
 #include <sstream>
 #include <sys/stat.h>
 
-#define CRCPP_USE_CPP11
-#include "CRC.h"
-
-#define DFS_BUFFERSIZE 4096
-
 /**
  * Clean the path and ensure it ends with a directory separator
  *
@@ -28,73 +23,6 @@ inline std::string dfs_clean_path(const std::string& path) {
     return mount_path;
 }
 
-/**
- * Calculate the crc checksum for a file
- *
- * @param filepath
- * @param table
- * @return
- */
-inline std::uint32_t dfs_file_checksum(const std::string &filepath, CRC::Table<std::uint32_t, 32> *table) {
-
-    struct stat st;
-    size_t file_size;
-    std::uint32_t crc = 0;
-    std::ifstream stream;
-    uint32_t chunk_count = 0;
-    uint32_t chunk_sequence = 0;
-    std::ifstream::pos_type current_position = 0;
-
-    stream.seekg(0, std::ios::beg);
-    if (lstat(filepath.c_str(), &st) != 0) {
-        return 0;
-    }
-
-    file_size = st.st_size;
-
-    std::uint32_t buffer_size = DFS_BUFFERSIZE;
-
-    // The crc works better if we have
-    // at least two chunks to work with
-    if (file_size < DFS_BUFFERSIZE) {
-        buffer_size = static_cast<uint32_t>(file_size / 2);
-        if (buffer_size <= 0) {
-            buffer_size = 1;
-        }
-    }
-
-    char buffer[buffer_size];
-
-    chunk_count = static_cast<uint32_t>(file_size / buffer_size) +
-                  static_cast<uint32_t>(static_cast<bool>(file_size % buffer_size));
-
-    stream.open(filepath, std::ios::in | std::ios::binary);
-
-    if (!stream.is_open()) {
-        return 0;
-    }
-
-    while(chunk_count != chunk_sequence) {
-        size_t read_size = (file_size - current_position < buffer_size) ?
-                           file_size - current_position :
-                           buffer_size;
-
-        if (!stream.read(buffer, read_size)) {
-            return crc;
-
-        }
-
-        crc = CRC::Calculate(buffer, sizeof(char) * buffer_size, *table, crc);
-
-        chunk_sequence++;
-        current_position = stream.tellg();
-
-    }
-
-    return crc;
-
-}
-
 /**
  * Logging levels
  */
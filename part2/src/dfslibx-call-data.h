@@ -1,6 +1,7 @@
 #ifndef PR4_DFSCALLDATAMANAGER_H
 #define PR4_DFSCALLDATAMANAGER_H
 
+#include <functional>
 #include <grpcpp/grpcpp.h>
 #include "dfs-utils.h"
 #include "../proto-src/dfs-service.grpc.pb.h"
@@ -24,6 +25,13 @@ public:
                                  void* tag) {}
     virtual void ProcessCallback(grpc::ServerContext* context, RequestT* request, ResponseT* response) {}
 
+    /**
+     * Hold a call back instead of processing it right away. A manager that
+     * returns true fills in the response later and then calls `finish`.
+     */
+    virtual bool DeferCallback(grpc::ServerContext* context, RequestT* request, ResponseT* response,
+                               const std::function<void()>& finish) { return false; }
+
 };
 
 /**
@@ -105,13 +113,15 @@ public:
             // part of its FINISH state.
             new DFSCallData<RequestT, ResponseT>(service, manager, cq);
 
-            manager->ProcessCallback(&ctx_, &request_, &reply_);
-
             // And we are done! Let the gRPC runtime know we've finished, using the
             // memory address of this instance as the uniquely identifying tag for
-            // the event.
+            // the event. A deferred call gets there once the manager answers it.
             status = FINISH;
-            responder.Finish(reply_, grpc::Status::OK, this);
+            if (!manager->DeferCallback(&ctx_, &request_, &reply_,
+                                        [this] { responder.Finish(reply_, grpc::Status::OK, this); })) {
+                manager->ProcessCallback(&ctx_, &request_, &reply_);
+                responder.Finish(reply_, grpc::Status::OK, this);
+            }
         } else {
             dfs_log(LL_DEBUG3) << "Proceed[Finish]";
             // GPR_ASSERT(status == FINISH);
@@ -12,12 +12,14 @@
 #include <getopt.h>
 #include <unistd.h>
 #include <limits.h>
+#include <sys/stat.h>
 #include <sys/inotify.h>
 #include <grpcpp/grpcpp.h>
 #include <utime.h>
 
 #include "dfs-utils.h"
 #include "dfslibx-clientnode-p2.h"
+#include "../dfslib-shared-p2.h"
 
 using grpc::Status;
 using grpc::Channel;
@@ -28,7 +30,9 @@ using grpc::ClientContext;
 
 extern dfs_log_level_e DFS_LOG_LEVEL;
 
-DFSClientNode::DFSClientNode() : mount_path("mnt/client/"), unmounting(false), crc_table(CRC::CRC_32()) {
+DFSClientNode::DFSClientNode() : mount_path("mnt/client/"), unmounting(false),
+    bulk_transfer(false), delta_sync(false), transfer_streams(1), stripe_size(DFS_STRIPE_SIZE),
+    lock_wait(0), one_step_lock(false), callback_version(0), sync_workers(DFS_SYNC_WORKERS) {
     char host[HOST_NAME_MAX];
     std::ostringstream ss_id;
     gethostname(host, HOST_NAME_MAX);
@@ -53,6 +57,7 @@ const std::string DFSClientNode::ClientId() {
 
 void DFSClientNode::CreateStub(std::shared_ptr <Channel> channel) {
     this->service_stub = dfs_service::DFSService::NewStub(channel);
+    this->bulk_stub = std::make_unique<grpc::GenericStub>(channel);
 }
 
 void DFSClientNode::SetMountPath(const std::string &path) {
@@ -63,6 +68,59 @@ void DFSClientNode::SetDeadlineTimeout(int deadline) {
     this->deadline_timeout = deadline;
 }
 
+void DFSClientNode::SetBulkTransfer(bool enabled) {
+    this->bulk_transfer = enabled;
+}
+
+void DFSClientNode::SetDeltaSync(bool enabled) {
+    this->delta_sync = enabled;
+}
+
+void DFSClientNode::SetTransferStreams(int streams, size_t stripe_size) {
+    this->transfer_streams = std::max(1, std::min(streams, DFS_MAX_TRANSFER_STREAMS));
+    this->stripe_size = std::max<size_t>(stripe_size, DFS_MIN_CHUNK_SIZE);
+}
+
+void DFSClientNode::SetLockWait(int lock_wait) {
+    this->lock_wait = std::max(0, lock_wait);
+}
+
+void DFSClientNode::SetOneStepLock(bool enabled) {
+    this->one_step_lock = enabled;
+}
+
+void DFSClientNode::InvalidateChecksum(const std::string &filename) {
+    this->checksum_cache.Invalidate(WrapPath(filename));
+}
+
+void DFSClientNode::QueueFileEvent(const std::string &filename, std::uint32_t mask) {
+    this->event_coalescer.Add(filename, mask);
+}
+
+void DFSClientNode::StartSync() {
+    this->sync_pool.Start(this->sync_workers);
+    this->event_coalescer.Start([this](const std::string &filename, DFSEventCoalescer::Action action) {
+        // A delete moves no file bytes, so it goes ahead of any store
+        struct stat st;
+        size_t size = 0;
+        if (action == DFSEventCoalescer::STORE && stat(WrapPath(filename).c_str(), &st) == 0) {
+            size = st.st_size;
+        }
+        this->sync_pool.Submit(filename, size, [this, filename, action] {
+            if (action == DFSEventCoalescer::STORE) {
+                Store(filename);
+            }
+            else {
+                Delete(filename);
+            }
+        });
+    });
+}
+
+void DFSClientNode::SetSyncWorkers(int workers) {
+    this->sync_workers = workers;
+}
+
 void DFSClientNode::SetClientId(const std::string &id) {
     this->client_id = id;
 }
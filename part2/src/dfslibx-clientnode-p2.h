@@ -7,9 +7,14 @@
 #include <limits.h>
 #include <chrono>
 #include <mutex>
+#include <cstdint>
 
 #include <grpcpp/grpcpp.h>
+#include <grpcpp/generic/generic_stub.h>
 #include "../proto-src/dfs-service.grpc.pb.h"
+#include "../dfslib-crc-p2.h"
+#include "../dfslib-sync-p2.h"
+#include "../dfslib-events-p2.h"
 
 /**
  * The containing structure used to pass async data
@@ -48,12 +53,45 @@ protected:
     /** Unmounting indicator - indicates when the client is unmounting **/
     bool unmounting;
 
-    /** CRC table kept in memory for faster calculations **/
-    CRC::Table<std::uint32_t, 32> crc_table;
+    /** Checksums of the files in the mount, kept until a file changes **/
+    DFSChecksumCache checksum_cache;
+
+    /** Runs the fetches, stores and deletes that keep the mount in sync **/
+    DFSSyncPool sync_pool;
+
+    /** Holds back the mount's file events until each file settles; feeds the sync pool, so it is declared after it **/
+    DFSEventCoalescer event_coalescer;
 
     /** The service stub **/
     std::unique_ptr<dfs_service::DFSService::Stub> service_stub;
 
+    /** The generic stub for bulk transfers **/
+    std::unique_ptr<grpc::GenericStub> bulk_stub;
+
+    /** Whether file bodies are sent over bulk transfer calls **/
+    bool bulk_transfer;
+
+    /** Whether large files are stored as rsync-style deltas **/
+    bool delta_sync;
+
+    /** Number of concurrent streams a striped transfer uses, 1 disables striping **/
+    int transfer_streams;
+
+    /** Size of each stripe of a striped transfer **/
+    size_t stripe_size;
+
+    /** How long a write lock request queues for a busy lock, 0 fails at once **/
+    int lock_wait;
+
+    /** Whether stores of small files and deletes take the write lock in the same call **/
+    bool one_step_lock;
+
+    /** Server index version of the last callback listing, 0 before the first **/
+    std::uint64_t callback_version;
+
+    /** Sync operations run at once while mounted **/
+    int sync_workers;
+
     /** The completion queue for async calls **/
     grpc::CompletionQueue completion_queue;
 
@@ -88,6 +126,64 @@ public:
      */
     void SetDeadlineTimeout(int deadline);
 
+    /**
+     * Sends file bodies as raw bulk transfer calls instead of FileData messages
+     * @param enabled
+     */
+    void SetBulkTransfer(bool enabled);
+
+    /**
+     * Stores large files as rsync-style deltas instead of content-defined chunks
+     * @param enabled
+     */
+    void SetDeltaSync(bool enabled);
+
+    /**
+     * Splits transfers of files larger than one stripe across concurrent streams
+     * @param streams
+     * @param stripe_size
+     */
+    void SetTransferStreams(int streams, size_t stripe_size);
+
+    /**
+     * Queues write lock requests for up to `lock_wait` milliseconds when
+     * another client holds the lock, instead of failing at once
+     * @param lock_wait
+     */
+    void SetLockWait(int lock_wait);
+
+    /**
+     * Takes the write lock with the store or delete call itself instead of
+     * a RequestWriteLock call first, which the server must support
+     * @param enabled
+     */
+    void SetOneStepLock(bool enabled);
+
+    /**
+     * Forgets the cached checksum of a file inotify reported as changed
+     * @param filename
+     */
+    void InvalidateChecksum(const std::string& filename);
+
+    /**
+     * Queues an inotify event of a file in the mount; the file is stored
+     * or deleted once its events settle
+     * @param filename
+     * @param mask
+     */
+    void QueueFileEvent(const std::string& filename, std::uint32_t mask);
+
+    /**
+     * Starts the sync workers, and syncing the files whose events have settled
+     */
+    void StartSync();
+
+    /**
+     * Sets how many sync operations run at once while mounted
+     * @param workers
+     */
+    void SetSyncWorkers(int workers);
+
     /**
      * Overrides the autogenerated client id for testing
      */
@@ -198,6 +294,7 @@ public:
         // Data we are sending to the server.
         RequestT request;
         request.set_name("");
+        request.set_since_version(this->callback_version);
 
         // Call object to store rpc data
         AsyncClientData<ResponseT>* call_data = new AsyncClientData<ResponseT>;
@@ -24,6 +24,8 @@
 
 #include "dfs-utils.h"
 #include "dfslibx-call-data.h"
+#include "../dfslib-shared-p2.h"
+#include "../dfslib-bulk-p2.h"
 #include "../proto-src/dfs-service.grpc.pb.h"
 
 /**
@@ -96,6 +98,47 @@ static void HandleSyncRPC(std::shared_ptr<grpc::Server> server) {
     server->Wait();
 }
 
+/**
+ * Static callback for accepting bulk transfer calls.
+ *
+ * Each accepted call is handed to the callback on its own thread, as the
+ * callback drives the call with blocking reads and writes until the
+ * transfer is complete.
+ *
+ * @param service
+ * @param cq
+ * @param callback
+ */
+static void HandleBulkRPC(grpc::AsyncGenericService* service,
+                          std::shared_ptr<grpc::ServerCompletionQueue> cq,
+                          std::function<void(DFSBulkServerCall*)> callback) {
+
+    DFSBulkServerCall* call = new DFSBulkServerCall();
+    service->RequestCall(&call->context, &call->stream, call->Queue(), cq.get(), call);
+
+    void* tag;
+
+    bool ok;
+
+    while (cq->Next(&tag, &ok)) {
+        DFSBulkServerCall* ready = static_cast<DFSBulkServerCall*>(tag);
+        if (!ok) {
+            // The server is shutting down
+            delete ready;
+            continue;
+        }
+
+        // Accept the next call before serving this one
+        call = new DFSBulkServerCall();
+        service->RequestCall(&call->context, &call->stream, call->Queue(), cq.get(), call);
+
+        std::thread([ready, callback] {
+            callback(ready);
+            delete ready;
+        }).detach();
+    }
+}
+
 /**
  * The DFSServiceRunner has been abstracted out of the DFSServiceImpl
  * in order to make it easier for students to focus on the specifics of the assignment.
@@ -132,6 +175,15 @@ protected:
 
     /** Queued requests callback **/
     std::function<void()> queued_requests_callback;
+
+    /** The generic service for bulk transfers **/
+    grpc::AsyncGenericService bulk_service;
+
+    /** The completion queue for new bulk calls **/
+    std::shared_ptr<grpc::ServerCompletionQueue> bulk_queue;
+
+    /** Bulk call callback **/
+    std::function<void(DFSBulkServerCall*)> bulk_callback;
 public:
 
     DFSServiceRunner() {}
@@ -144,6 +196,10 @@ public:
         this->queued_requests_callback = queued_requests_callback;
     }
 
+    void SetBulkCallback(std::function<void(DFSBulkServerCall*)> bulk_callback) {
+        this->bulk_callback = bulk_callback;
+    }
+
     void SetAddress(const std::string& server_address) {
         this->server_address = server_address;
     }
@@ -163,6 +219,11 @@ public:
         grpc::ServerBuilder builder;
         builder.AddListeningPort(this->server_address, grpc::InsecureServerCredentials());
         builder.RegisterService(this->service);
+        builder.SetMaxReceiveMessageSize(DFS_MAX_MESSAGE_SIZE);
+        if (this->bulk_callback) {
+            builder.RegisterAsyncGenericService(&this->bulk_service);
+            this->bulk_queue = builder.AddCompletionQueue();
+        }
         this->completion_queue = builder.AddCompletionQueue();
         this->server = builder.BuildAndStart();
         dfs_log(LL_SYSINFO) << "DFSServerNode server listening on " << this->server_address;
@@ -184,6 +245,13 @@ public:
         dfs_log(LL_SYSINFO) << "Server thread " << " started";
         threads.push_back(std::move(thread_server));
 
+        // Accept bulk transfer calls on a separate thread
+        if (this->bulk_callback) {
+            std::thread thread_bulk(HandleBulkRPC, &this->bulk_service, this->bulk_queue, this->bulk_callback);
+            dfs_log(LL_SYSINFO) << "Bulk thread " << " started";
+            threads.push_back(std::move(thread_bulk));
+        }
+
         // Start the queue processor
         std::thread thread_queue(queued_requests_callback);
         dfs_log(LL_SYSINFO) << "Queue thread " << " started";
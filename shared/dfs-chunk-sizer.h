@@ -0,0 +1,90 @@
+#ifndef PR4_DFS_CHUNK_SIZER_H
+#define PR4_DFS_CHUNK_SIZER_H
+
+#include <chrono>
+#include <cstddef>
+#include <algorithm>
+
+//
+// The adaptive chunk sizer both parts stream with.
+//
+// Include it after the part's src/dfs-utils.h, which provides dfs_log.
+//
+
+/** Smallest chunk the adaptive streamer sends (64 KB) **/
+#define DFS_MIN_CHUNK_SIZE (64 * 1024)
+
+/** Number of chunks measured before the chunk size is re-evaluated **/
+#define DFS_CHUNK_WINDOW 4
+
+/**
+ * Picks the size of the next FileData chunk for a stream.
+ *
+ * Starts at DFS_MIN_CHUNK_SIZE and doubles while the observed
+ * throughput keeps up, halving again if it falls off, never going
+ * past the limit negotiated with the peer.
+ */
+class DFSChunkSizer {
+
+private:
+    /** Current chunk size **/
+    size_t chunk_size;
+
+    /** Upper bound negotiated with the peer **/
+    size_t max_chunk_size;
+
+    /** Bytes written in the current measurement window **/
+    size_t window_bytes;
+
+    /** Time spent writing in the current measurement window **/
+    std::chrono::steady_clock::duration window_time;
+
+    /** Throughput of the previous window in bytes per second **/
+    double last_rate;
+
+public:
+    explicit DFSChunkSizer(size_t max_chunk_size) :
+        chunk_size(std::min<size_t>(DFS_MIN_CHUNK_SIZE, max_chunk_size)),
+        max_chunk_size(max_chunk_size),
+        window_bytes(0),
+        window_time(std::chrono::steady_clock::duration::zero()),
+        last_rate(0) {}
+
+    /** The size to use for the next chunk **/
+    size_t ChunkSize() const { return this->chunk_size; }
+
+    /**
+     * Record a completed write and adjust the chunk size
+     *
+     * @param bytes
+     * @param elapsed
+     */
+    void Record(size_t bytes, std::chrono::steady_clock::duration elapsed) {
+        this->window_bytes += bytes;
+        this->window_time += elapsed;
+
+        // Judge a size over several writes so a single stalled write doesn't swing it
+        if (this->window_bytes < DFS_CHUNK_WINDOW * this->chunk_size) {
+            return;
+        }
+
+        double seconds = std::chrono::duration<double>(this->window_time).count();
+        double rate = this->window_bytes / std::max(seconds, 1e-6);
+
+        if (rate >= this->last_rate * 0.9) {
+            this->chunk_size = std::min(this->chunk_size * 2, this->max_chunk_size);
+        }
+        else if (rate < this->last_rate * 0.75) {
+            this->chunk_size = std::max<size_t>(this->chunk_size / 2,
+                std::min<size_t>(DFS_MIN_CHUNK_SIZE, this->max_chunk_size));
+        }
+
+        dfs_log(LL_DEBUG2) << "Chunk window rate " << rate << " B/s, next chunk size " << this->chunk_size;
+
+        this->last_rate = rate;
+        this->window_bytes = 0;
+        this->window_time = std::chrono::steady_clock::duration::zero();
+    }
+};
+
+#endif